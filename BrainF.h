@@ -17,74 +17,345 @@
 #include "llvm/PassManager.h"
 #include "llvm/Support/IRBuilder.h"
 #include "llvm/ADT/DenseMap.h"
-#include "llvm/ADT/DenseSet.h"
-
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
 
 using namespace llvm;
 
+#define TRACE_BUF_SIZE       128
+#define TRACE_THRESHOLD      100
+#define BACKEDGE_THRESHOLD     5
+#define BLACKLIST_PERIOD      32
+#define MAX_BACKOFF           16
+#define MAX_BACKEDGE_BACKOFF   4
+#define TIER2_THRESHOLD    10000
+#define MAX_TREE_SIZE       4096
+#define MAX_BRANCHES           8
+
+struct BrainFVM;
+
 class BrainFTraceRecorder {
+  // Special values of the links between nodes.  The root is node 0, and
+  // can only be reached through TRACE_HEAD, so 0 is free to mean that an
+  // edge has not been traced.
+  static const uint32_t UNTRACED = 0;
+  static const uint32_t TRACE_HEAD = ~0U;
+  
   struct BrainFTraceNode {
+    uint32_t pc;
+    uint16_t depth;
     uint8_t opcode;
-    size_t pc;
-    size_t depth;
+    
+    // On an if, left is the x != 0 edge.  Each link is the index of a node
+    // in the same tree, UNTRACED or TRACE_HEAD.
+    uint32_t left, right;
+    
     BrainFTraceNode(uint8_t o, size_t p, size_t d)
-      : opcode(o), pc(p), depth(d), left(0), right(0)  { }
-    void dump(unsigned level);
+      : pc(p), depth(d), opcode(o), left(UNTRACED), right(UNTRACED) { }
+  };
+  
+  // A trace tree.  Its nodes are kept together in one array, in the order
+  // they were committed, which keeps each trace mostly contiguous.
+  struct BrainFTrace {
+    std::vector<BrainFTraceNode> nodes;
+    
+    // The tier the tree is to be compiled in, and the number of times its
+    // tier 1 code has reached the head.
+    uint8_t tier;
+    uint32_t iterations;
     
-    // On an if, left is the x != 0 edge.
-    // A value of 0 indicates an un-traced edge.
-    // A value of ~0ULL indicates an edge to the trace head.
-    BrainFTraceNode *left, *right;
+    // In a snapshot handed to the compiler thread, the live tree it was
+    // copied from.  Compiled code refers to live trees.
+    BrainFTrace *original;
+    
+    BrainFTrace() : tier(1), iterations(0), original(this) { }
+    BrainFTraceNode &root() { return nodes[0]; }
+    void dump(uint32_t node, unsigned level);
+  };
+  
+  // A version of the machine code compiled for a tree or for a branch of
+  // one, and the versions it calls directly, which must outlive it.  links
+  // counts the live versions that call it, plus one while it is installed.
+  // When that drops to zero the version is retired, and it is freed once
+  // the interpreter has left every trace since, that is, once
+  // quiescent_epoch reaches retired_at.
+  //
+  // A whole tree's version also owns the slots its side exits, and those of
+  // its branches, jump through, by the index of the node they leave from.
+  // Each slot holds the branch compiled for the exit, or null until then.
+  // The branches count as called by the tree.
+  struct BrainFCodeVersion {
+    Function *function;
+    void *code;
+    unsigned links;
+    std::vector<BrainFCodeVersion*> callees;
+    size_t retired_at;
+    std::map<uint32_t, void*> *slots;
+    BrainFCodeVersion(Function *F, void *C)
+      : function(F), code(C), links(1), retired_at(0), slots(0) { }
+  };
+  
+  // The compiler thread's record of a tree it has compiled: the snapshot it
+  // compiled last, the pcs its side exits lead to that had no compiled
+  // trace to link to at the time, and the version installed for the whole
+  // tree, with the number of branches compiled onto it since.
+  struct BrainFCompiledTrace {
+    BrainFTrace *snapshot;
+    std::vector<size_t> unlinked_exits;
+    BrainFCodeVersion *root;
+    unsigned branches;
+    BrainFCompiledTrace() : snapshot(0), root(0), branches(0) { }
+  };
+  
+  // The code generation state of one tier of the JIT.  Tier 1 compiles new
+  // trees quickly, with few passes and little codegen effort.  Trees whose
+  // tier 1 code stays hot are recompiled by tier 2 with the full pipeline.
+  // Each tier is created the first time a tree is compiled in it.
+  struct BrainFJITTier {
+    Module *module;
+    ExecutionEngine *EE;
+    FunctionPassManager *FPM;
+    GlobalValue *ext_root, *ext_leaf;
+    GlobalValue *output_cur, *output_end, *input_cur, *input_end;
+    GlobalValue *tape_begin, *tape_end;
+    Value *flush_func, *refill_func, *scan_func, *promote_func;
+    BrainFJITTier() : module(0), EE(0), FPM(0) { }
   };
   
   static const uint8_t MODE_PROFILING = 0;
   static const uint8_t MODE_RECORDING = 1;
   static const uint8_t MODE_EXTENSION_BEGIN = 2;
   static const uint8_t MODE_EXTENSION = 3;
+  
+  // A blacklisted side exit.  Recording an extension from it is skipped the
+  // next skip times it is taken.  Each failure to record an extension from
+  // it doubles the period.
+  struct BrainFBlacklistEntry {
+    uint32_t skip;
+    uint8_t backoff;
+    BrainFBlacklistEntry() : skip(0), backoff(0) { }
+  };
 
-  size_t backedge_count;
+  // The VM whose program is being traced, and the LLVM context its code is
+  // compiled in.  Each VM has its own, so that VMs on different threads
+  // can compile at the same time.
+  BrainFVM *VM;
+  LLVMContext Context;
+  
+  size_t backedge_count, backedge_limit;
 
   uint8_t mode;
-  BrainFTraceNode *extension_root, *extension_leaf;
+  // False if the recorder only profiles, as with -no-jit.
+  bool jit_enabled;
+  // The tree a compiled trace was last entered at, and the index of the node
+  // it last side exited from.  Both are written by compiled code.
+  BrainFTrace *extension_root;
+  size_t extension_leaf;
+  size_t extension_pc;
+  // The values of extension_root and extension_leaf across a recorded call
+  // to a compiled trace, which overwrites them.
+  BrainFTrace *call_root;
+  size_t call_leaf;
   
-  uint8_t *iteration_count;
   std::pair<uint8_t, size_t> *trace_begin, *trace_end, *trace_tail;
-  DenseMap<size_t, BrainFTraceNode*> trace_map;
-  DenseSet<size_t> blacklist;
-  Module *module;
+  
+  // The bounds checked by the inline fast path of record_simple.  Outside
+  // of MODE_RECORDING and MODE_EXTENSION, record_limit is trace_begin so
+  // that the fast path is never taken.
+  std::pair<uint8_t, size_t> *record_limit;
+  size_t record_head;
+  
+  DenseMap<size_t, BrainFTrace*> trace_map;
+  DenseMap<size_t, BrainFBlacklistEntry> blacklist;
   BasicBlock *Header;
-  Value *DataPtr;
+  Value *DataArg, *DataPtr;
   PHINode *HeaderPHI;
-  ExecutionEngine *EE;
+  BrainFTraceNode *Nodes;
+  Value *ExtRoot;
+  std::vector<size_t> UnlinkedExits;
+  DenseMap<BrainFTrace*, BrainFCompiledTrace> compiled;
+  
+  // Every version of trace code not yet freed, by its address, the versions
+  // waiting to be freed, and the code the tree being compiled calls.
+  DenseMap<void*, BrainFCodeVersion*> versions;
+  std::vector<BrainFCodeVersion*> retired;
+  std::vector<void*> Callees;
+  
+  // While compiling for the JIT, the slots of the tree's version, which
+  // the side exits being compiled jump through.
+  std::map<uint32_t, void*> *Slots;
+  
+  /// BrainFCell - What the code being compiled knows about a cell of the
+  /// tape.  Its current value is value, or the value in memory if that is
+  /// null, plus delta.  Memory is out of date if it is dirty or delta is
+  /// nonzero.
+  struct BrainFCell {
+    Value *value;
+    uint8_t delta;
+    bool dirty;
+    bool nonzero;
+    BrainFCell() : value(0), delta(0), dirty(false), nonzero(false) { }
+  };
+  
+  // Along the path being compiled, the offset of the data pointer from
+  // DataPtr, and the cells known by their offsets from DataPtr.  Pointer
+  // motion and cell updates are folded into these, and only written to
+  // the tape when the trace leaves or loops, or calls something that
+  // reads it.
+  int32_t Offset;
+  std::map<int32_t, BrainFCell> Cells;
+  
+  // While compiling a run of '.' nodes, the output buffer position of the
+  // next one, and the number of bytes left of the room made for the run.
+  Value *OutputPtr;
+  unsigned OutputReserved;
+  
+  // Set while compile_path is compiling a path, and then the link to the
+  // node it is to compile next.
+  bool Walking;
+  uint32_t NextLink;
 
   const IntegerType *int_type;
   const FunctionType *op_type;
-  GlobalValue *bytecode_array, *mode_flag, *ext_root, *ext_leaf;
-  Value *getchar_func, *putchar_func;
-  FunctionPassManager *FPM;
+  BrainFJITTier tiers[2];
+  BrainFJITTier *Tier;
+  
+  // When compiling the whole program ahead of time, the function compiled
+  // for each loop, by the pc of its '['.  Calls to inner loops go to these
+  // instead of to installed traces.
+  DenseMap<size_t, Function*> AOTLoops;
   
+  // Committed trees are compiled on a separate thread, which owns all of the
+  // LLVM state above.  It is started when the first tree is committed, so
+  // that programs which never get hot do not pay for setting up the JIT.
+  // The queue holds snapshots of the trees, so that the recorder can keep
+  // extending the live ones.
+  bool compile_thread_started;
+  pthread_t compile_thread;
+  pthread_mutex_t queue_lock;
+  pthread_cond_t queue_cond;
+  std::deque<BrainFTrace*> compile_queue;
+  bool shutting_down;
   
+  void set_mode(uint8_t new_mode);
+  void begin_trace(size_t pc);
+  bool begin_extension(size_t pc);
+  void abort_recording(bool too_many_backedges);
+  void record_slow(size_t pc, uint8_t opcode, size_t next_pc);
+  void commit_path(BrainFTrace *tree, uint32_t parent,
+                   std::pair<uint8_t, size_t> *trace_iter);
   void commit();
   void commit_extension();
+  void schedule_compile(BrainFTrace *tree);
+  static void *compile_thread_main(void *recorder);
+  void compile_loop();
+  bool is_queued(BrainFTrace *tree);
+  void relink(size_t pc);
+  BrainFCodeVersion *add_version(Function *function, void *code,
+                                 void *old_code);
+  void release(BrainFCodeVersion *version);
+  void free_version(BrainFCodeVersion *version);
+  void reclaim();
+  static void promote(BrainFTraceRecorder *recorder, BrainFTrace *tree);
   void initialize_module();
-  void compile(BrainFTraceNode* trace);
+  void initialize_tier(BrainFJITTier &T, unsigned level);
+  void compile(BrainFTrace* trace);
+  Function *compile_function(BrainFTrace *trace);
+  bool compile_branches(BrainFTrace *trace, BrainFCompiledTrace &record);
+  void compile_branch(BrainFTrace *trace, BrainFCompiledTrace &record,
+                      uint32_t leaf, uint32_t link, size_t exit_pc);
+  Function *compile_branch_function(BrainFTrace *trace, uint32_t link,
+                                    size_t exit_pc);
+  void initialize_aot(BrainFJITTier &T);
+  void compile_main(const std::vector<Function*> &pieces, size_t tape_offset);
+  BrainFTrace *build_tree(size_t begin, size_t end, bool loop);
+  size_t successor(const BrainFTraceNode &node, bool right);
+  bool emit_program(const std::string &path);
+  Value *trace_callee(size_t pc, IRBuilder<>& builder);
+  Value *data_ptr(IRBuilder<>& builder);
+  Value *load_cell(int32_t offset, IRBuilder<>& builder);
+  void flush_cell(int32_t offset, IRBuilder<>& builder);
+  void flush_cells(IRBuilder<>& builder);
+  void reset_cells(Value *ptr);
+  void offset_range(uint32_t node, int32_t &lo, int32_t &hi);
+  void compile_range_check(uint32_t node, size_t exit_pc,
+                           IRBuilder<>& builder);
+  void compile_link(uint32_t link, IRBuilder<>& builder);
+  void compile_path(uint32_t link, IRBuilder<>& builder);
+  void compile_edge(BrainFTraceNode *node, uint32_t link, size_t exit_pc,
+                    IRBuilder<>& builder);
+  void compile_child(BrainFTraceNode *node, uint32_t link, size_t exit_pc,
+                     IRBuilder<>& builder);
+  unsigned count_puts(BrainFTraceNode *node);
   void compile_opcode(BrainFTraceNode *node, IRBuilder<>& builder);
-  void compile_plus(BrainFTraceNode *node, IRBuilder<>& builder);
-  void compile_minus(BrainFTraceNode *node, IRBuilder<>& builder);
-  void compile_left(BrainFTraceNode *node, IRBuilder<>& builder);
-  void compile_right(BrainFTraceNode *node, IRBuilder<>& builder);
+  void compile_add(BrainFTraceNode *node, IRBuilder<>& builder);
+  void compile_move(BrainFTraceNode *node, IRBuilder<>& builder);
+  void compile_mul(BrainFTraceNode *node, IRBuilder<>& builder);
+  void compile_scan(BrainFTraceNode *node, IRBuilder<>& builder);
   void compile_put(BrainFTraceNode *node, IRBuilder<>& builder);
   void compile_get(BrainFTraceNode *node, IRBuilder<>& builder);
   void compile_if(BrainFTraceNode *node, IRBuilder<>& builder);
+  void compile_exit(BrainFTraceNode *node, size_t exit_pc,
+                    IRBuilder<>& builder);
+  void compile_call(BrainFTraceNode *node, IRBuilder<>& builder);
   void compile_back(BrainFTraceNode *node, IRBuilder<>& builder);  
   void compile_set_zero(BrainFTraceNode *node, IRBuilder<>& builder);                                        
+  void compile_end(BrainFTraceNode *node, IRBuilder<>& builder);
   
 public:
-  BrainFTraceRecorder();
+  BrainFTraceRecorder(BrainFVM *vm, bool jit = true);
   ~BrainFTraceRecorder();
   
+  /// is_recording - Returns true if the recorder needs to observe every
+  /// executed instruction, and false if only loop headers need profiling.
+  /// The interpreter runs handlers specialized on this.
+  bool is_recording() const { return mode != MODE_PROFILING; }
+  
+  void profile(size_t pc);
+  
+  /// exit_trace - Notify the recorder that a compiled trace has just side
+  /// exited, so that it may record an extension from the exit, unless the
+  /// trace left no extension root, as it does when it refuses to run.
+  void exit_trace() {
+    if (extension_root)
+      set_mode(MODE_EXTENSION_BEGIN);
+  }
+  
   void record(size_t pc, uint8_t opcode, size_t next_pc);
-  void record_simple(size_t pc, uint8_t opcode, size_t next_pc);
+  void enter_call(size_t pc);
+  void record_call(size_t pc, size_t next_pc);
+  
+  /// load_cache - Install the trees saved to the cache file at path by an
+  /// earlier run of the program with the given key, and queue them for
+  /// compilation.  Returns false if there is no usable cache file.
+  bool load_cache(const std::string &path, uint64_t key);
+  
+  /// save_cache - Save the committed trees to the cache file at path, for
+  /// later runs of the program with the given key.
+  void save_cache(const std::string &path, uint64_t key);
+  
+  /// compile_program - Compile the whole program of the VM ahead of time,
+  /// with tape_offset cells to the left of the starting cell, and write it
+  /// to path: as bitcode if path ends in .bc, assembly if .s, an object file
+  /// if .o, and otherwise an executable linked by the system C compiler.
+  /// Returns false, having said why, if it could not.
+  bool compile_program(const std::string &path, size_t tape_offset);
+  
+  /// record_simple - Record a non-branching instruction.  Appending to the
+  /// trace buffer is done inline; buffer overflow, loop back-edges, returning
+  /// to the trace head and starting an extension are left to record_slow.
+  void record_simple(size_t pc, uint8_t opcode, size_t next_pc) {
+    if (trace_tail < record_limit && opcode != ']' && next_pc != record_head) {
+      trace_tail->first = opcode;
+      trace_tail->second = pc;
+      ++trace_tail;
+      return;
+    }
+    record_slow(pc, opcode, next_pc);
+  }
 };
 
 #endif
@@ -0,0 +1,424 @@
+//===-- BrainFAOT.cpp - BrainF ahead-of-time compiler ---------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------===//
+//
+// With -aot, the whole program is compiled into one module up front and
+// written out instead of being run.  Each loop is turned into the trace tree
+// that recording every path through it would have produced: its body is a
+// single path, since only loops branch, and each inner loop on it becomes a
+// call node.  The trees are compiled by the trace compiler, innermost loop
+// first, so that every call has its callee to go to.  The rest of the
+// program becomes a sequence of trees, each ending where the next begins,
+// which main calls in turn.
+//
+// The module defines its own tape, I/O buffers and main, so the object
+// file needs nothing but the C library, and runs with no recorder, no
+// profiling and no JIT.  All of the loop functions are internal, and are
+// inlined into the program's by the standard module pipeline.
+//===--------------------------------------------------------------------===//
+
+#include "BrainF.h"
+#include "BrainFVM.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/StandardPasses.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/System/Host.h"
+#include "llvm/System/Path.h"
+#include "llvm/System/Program.h"
+#include "llvm/Target/TargetData.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetRegistry.h"
+#include "llvm/Target/TargetSelect.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/StringExtras.h"
+#include <sys/mman.h>
+
+/// AOT_CHUNK - The most instructions and calls in each of the pieces the
+/// code outside of any loop is compiled in.  The trace compiler recurses
+/// once per node along a path, so a whole large program would overflow the
+/// stack as a single tree.
+#define AOT_CHUNK 1024
+
+/// NodeOpcodes - The trace node opcode of each instruction, indexed by
+/// BrainFOpcode.
+static const char NodeOpcodes[] = { '+', '>', 's', '*', '.', ',', '[', ']',
+                                    '0' };
+
+/// initialize_aot - Create the module the program is compiled into, and
+/// define in it the runtime that the JIT tiers bind to the VM's own: the
+/// I/O buffers and the functions that empty and refill them, and the scan
+/// kernel.  Without signal handlers, read and write are never interrupted,
+/// so unlike the VM's they do not retry on EINTR.
+void BrainFTraceRecorder::initialize_aot(BrainFJITTier &T) {
+  Module *M = T.module = new Module("BrainF.aot", Context);
+  const IntegerType *byte_type = IntegerType::getInt8Ty(Context);
+  const IntegerType *i32_type = IntegerType::getInt32Ty(Context);
+  const PointerType *data_type = PointerType::getUnqual(byte_type);
+  const ArrayType *buf_type = ArrayType::get(byte_type, IO_BUF_SIZE);
+  Constant *Zero = ConstantInt::get(int_type, 0);
+  
+  // Nothing reads the extension root and leaf, so the stores to them on
+  // the way out of each loop are optimized away.
+  T.ext_root = new GlobalVariable(*M, int_type, false,
+                                  GlobalValue::InternalLinkage, Zero,
+                                  "ext_root");
+  T.ext_leaf = new GlobalVariable(*M, int_type, false,
+                                  GlobalValue::InternalLinkage, Zero,
+                                  "ext_leaf");
+  
+  Value *OutputBuffer =
+    new GlobalVariable(*M, buf_type, false, GlobalValue::InternalLinkage,
+                       ConstantAggregateZero::get(buf_type), "output_buffer");
+  Value *InputBuffer =
+    new GlobalVariable(*M, buf_type, false, GlobalValue::InternalLinkage,
+                       ConstantAggregateZero::get(buf_type), "input_buffer");
+  GlobalValue **Cursors[4] = { &T.output_cur, &T.output_end,
+                               &T.input_cur, &T.input_end };
+  const char *CursorNames[4] = { "output_cur", "output_end",
+                                 "input_cur", "input_end" };
+  for (unsigned i = 0; i != 4; ++i)
+    *Cursors[i] = new GlobalVariable(*M, data_type, false,
+                                     GlobalValue::InternalLinkage,
+                                     ConstantPointerNull::get(data_type),
+                                     CursorNames[i]);
+  
+  Value *Write = M->getOrInsertFunction("write", int_type, i32_type,
+                                        data_type, int_type, NULL);
+  Value *Read = M->getOrInsertFunction("read", int_type, i32_type,
+                                       data_type, int_type, NULL);
+  
+  // brainf_flush - Write out the output buffer, giving up on an error, and
+  // return the new output_cur.  Like the VM's, it and brainf_refill take
+  // the slot holding the data pointer, which they have no use for here.
+  std::vector<const Type*> Args;
+  Args.push_back(PointerType::getUnqual(data_type));
+  Function *Flush =
+    Function::Create(FunctionType::get(data_type, Args, false),
+                     Function::InternalLinkage, "brainf_flush", M);
+  T.flush_func = Flush;
+  BasicBlock *Entry = BasicBlock::Create(Context, "entry", Flush);
+  BasicBlock *Loop = BasicBlock::Create(Context, "loop", Flush);
+  BasicBlock *More = BasicBlock::Create(Context, "write", Flush);
+  BasicBlock *Advance = BasicBlock::Create(Context, "advance", Flush);
+  BasicBlock *Done = BasicBlock::Create(Context, "done", Flush);
+  IRBuilder<> builder(Entry);
+  Value *Begin = builder.CreateConstInBoundsGEP2_32(OutputBuffer, 0, 0);
+  Value *End = builder.CreatePtrToInt(builder.CreateLoad(T.output_cur),
+                                      int_type);
+  builder.CreateBr(Loop);
+  
+  builder.SetInsertPoint(Loop);
+  PHINode *Pos = builder.CreatePHI(data_type);
+  Pos->addIncoming(Begin, Entry);
+  Value *Left = builder.CreateSub(End, builder.CreatePtrToInt(Pos, int_type));
+  builder.CreateCondBr(builder.CreateICmpEQ(Left, Zero), Done, More);
+  
+  builder.SetInsertPoint(More);
+  Value *Written = builder.CreateCall3(Write, ConstantInt::get(i32_type, 1),
+                                       Pos, Left);
+  builder.CreateCondBr(builder.CreateICmpSGT(Written, Zero), Advance, Done);
+  
+  builder.SetInsertPoint(Advance);
+  Pos->addIncoming(builder.CreateInBoundsGEP(Pos, Written), Advance);
+  builder.CreateBr(Loop);
+  
+  builder.SetInsertPoint(Done);
+  builder.CreateStore(Begin, T.output_cur);
+  builder.CreateRet(Begin);
+  
+  // brainf_refill - Flush the output, then read ahead more input.  Returns
+  // the first byte read, or 255 at the end of input.
+  Function *Refill =
+    Function::Create(FunctionType::get(byte_type, Args, false),
+                     Function::InternalLinkage, "brainf_refill", M);
+  T.refill_func = Refill;
+  Entry = BasicBlock::Create(Context, "entry", Refill);
+  BasicBlock *Got = BasicBlock::Create(Context, "got", Refill);
+  BasicBlock *Eof = BasicBlock::Create(Context, "eof", Refill);
+  builder.SetInsertPoint(Entry);
+  builder.CreateCall(Flush, Refill->arg_begin());
+  Begin = builder.CreateConstInBoundsGEP2_32(InputBuffer, 0, 0);
+  Value *Count = builder.CreateCall3(Read, ConstantInt::get(i32_type, 0),
+                                     Begin,
+                                     ConstantInt::get(int_type, IO_BUF_SIZE));
+  builder.CreateCondBr(builder.CreateICmpSGT(Count, Zero), Got, Eof);
+  
+  builder.SetInsertPoint(Got);
+  builder.CreateStore(builder.CreateConstInBoundsGEP1_32(Begin, 1),
+                      T.input_cur);
+  builder.CreateStore(builder.CreateInBoundsGEP(Begin, Count), T.input_end);
+  builder.CreateRet(builder.CreateLoad(Begin));
+  
+  builder.SetInsertPoint(Eof);
+  builder.CreateRet(ConstantInt::get(byte_type, 255));
+  
+  // brainf_scan - Return the first zero cell at or after the given one
+  // along the given stride.
+  Args.push_back(data_type);
+  Args.push_back(i32_type);
+  Function *Scan =
+    Function::Create(FunctionType::get(data_type, Args, false),
+                     Function::InternalLinkage, "brainf_scan", M);
+  T.scan_func = Scan;
+  Entry = BasicBlock::Create(Context, "entry", Scan);
+  Loop = BasicBlock::Create(Context, "loop", Scan);
+  Done = BasicBlock::Create(Context, "done", Scan);
+  builder.SetInsertPoint(Entry);
+  Argument *Start = Scan->arg_begin();
+  Argument *Stride32 = ++Scan->arg_begin();
+  Value *Stride = builder.CreateSExt(Stride32, int_type);
+  builder.CreateBr(Loop);
+  
+  builder.SetInsertPoint(Loop);
+  Pos = builder.CreatePHI(data_type);
+  Pos->addIncoming(Start, Entry);
+  Pos->addIncoming(builder.CreateGEP(Pos, Stride), Loop);
+  builder.CreateCondBr(
+    builder.CreateICmpEQ(builder.CreateLoad(Pos),
+                         ConstantInt::get(byte_type, 0)),
+    Done, Loop);
+  
+  builder.SetInsertPoint(Done);
+  builder.CreateRet(Pos);
+  
+}
+
+/// build_tree - Build the trace tree for the code in [begin, end), with
+/// every instruction on one path and each inner loop a call node.  A loop
+/// tree starts at the '[' at begin, and end is its ']', which returns to
+/// the head.  Otherwise the tree ends with an 'E' node at end.
+BrainFTraceRecorder::BrainFTrace *
+BrainFTraceRecorder::build_tree(size_t begin, size_t end, bool loop) {
+  BrainFTrace *Tree = new BrainFTrace();
+  Tree->tier = 2;
+  std::vector<BrainFTraceNode> &Nodes = Tree->nodes;
+  
+  // The previous node, and whether the path continues along its right
+  // link, as it does after a call.
+  uint32_t Last = 0;
+  bool LastRight = false;
+  
+  size_t pc = begin;
+  if (loop)
+    Nodes.push_back(BrainFTraceNode('[', pc++, 0));
+  
+  for (;;) {
+    uint8_t Opcode = pc == end ? (loop ? ']' : 'E') :
+                     NodeOpcodes[VM->code[pc].opcode];
+    if (Opcode == '[')
+      Opcode = 'T';
+  
+    uint32_t Index = Nodes.size();
+    Nodes.push_back(BrainFTraceNode(Opcode, pc, Index));
+    if (Index) {
+      if (LastRight)
+        Nodes[Last].right = Index;
+      else
+        Nodes[Last].left = Index;
+    }
+    Last = Index;
+    LastRight = Opcode == 'T';
+  
+    if (pc == end)
+      break;
+    pc = Opcode == 'T' ? VM->code[pc].target+1 : pc+1;
+  }
+  
+  if (loop)
+    Nodes.back().right = TRACE_HEAD;
+  return Tree;
+}
+
+/// emit_program - Optimize the program's module, and write it to path in
+/// the form its extension asks for.
+bool BrainFTraceRecorder::emit_program(const std::string &path) {
+  Module *M = Tier->module;
+  std::string Error;
+  
+  // Inline the loops into each other, then optimize the result as a whole.
+  PassManager Passes;
+  Passes.add(new TargetData(M));
+  createStandardModulePasses(&Passes, 3, false, true, true, true, false,
+                             createFunctionInliningPass());
+  Passes.run(*M);
+  
+  bool Bitcode = StringRef(path).endswith(".bc");
+  bool Assembly = StringRef(path).endswith(".s");
+  bool Object = StringRef(path).endswith(".o");
+  if (Bitcode) {
+    raw_fd_ostream Out(path.c_str(), Error, raw_fd_ostream::F_Binary);
+    if (!Error.empty()) {
+      errs() << "Error: " << Error << "\n";
+      return false;
+    }
+    WriteBitcodeToFile(M, Out);
+    return true;
+  }
+  
+  InitializeNativeTargetAsmPrinter();
+  std::string Triple = sys::getHostTriple();
+  const Target *TheTarget = TargetRegistry::lookupTarget(Triple, Error);
+  if (!TheTarget) {
+    errs() << "Error: " << Error << "\n";
+    return false;
+  }
+  
+  // An executable is linked from an object file next to it.
+  std::string ObjectPath = Assembly || Object ? path : path + ".o";
+  TargetMachine::setRelocationModel(Reloc::PIC_);
+  OwningPtr<TargetMachine> TM(TheTarget->createTargetMachine(Triple, ""));
+  M->setTargetTriple(Triple);
+  {
+    raw_fd_ostream Out(ObjectPath.c_str(), Error, raw_fd_ostream::F_Binary);
+    if (!Error.empty()) {
+      errs() << "Error: " << Error << "\n";
+      return false;
+    }
+    formatted_raw_ostream FOS(Out);
+    PassManager CodeGen;
+    CodeGen.add(new TargetData(*TM->getTargetData()));
+    if (TM->addPassesToEmitFile(CodeGen, FOS,
+                                Assembly ? TargetMachine::CGFT_AssemblyFile
+                                         : TargetMachine::CGFT_ObjectFile,
+                                CodeGenOpt::Aggressive)) {
+      errs() << "Error: the target does not support emitting this kind of "
+                "file\n";
+      return false;
+    }
+    CodeGen.run(*M);
+  }
+  if (Assembly || Object)
+    return true;
+  
+  sys::Path CC = sys::Program::FindProgramByName("cc");
+  if (CC.isEmpty()) {
+    errs() << "Error: no C compiler to link " << path << " with\n";
+    return false;
+  }
+  const char *LinkArgs[] = { "cc", "-o", path.c_str(), ObjectPath.c_str(),
+                             0 };
+  int Status = sys::Program::ExecuteAndWait(CC, LinkArgs, 0, 0, 0, 0, &Error);
+  sys::Path(ObjectPath).eraseFromDisk();
+  if (Status) {
+    errs() << "Error: linking " << path << " failed";
+    if (!Error.empty())
+      errs() << ": " << Error;
+    errs() << "\n";
+    return false;
+  }
+  return true;
+}
+
+/// compile_main - Define main, which maps the tape, with tape_offset cells
+/// to the left of the starting cell, and runs the pieces of the program in
+/// order.  Mapping the tape readable and writable up front leaves it to the
+/// kernel to back the cells as they are touched.
+void BrainFTraceRecorder::compile_main(const std::vector<Function*> &pieces,
+                                       size_t tape_offset) {
+  Module *M = Tier->module;
+  const IntegerType *i32_type = IntegerType::getInt32Ty(Context);
+  const PointerType *data_type =
+    PointerType::getUnqual(IntegerType::getInt8Ty(Context));
+  Value *Mmap = M->getOrInsertFunction("mmap", data_type, data_type,
+                                       int_type, i32_type, i32_type,
+                                       i32_type, int_type, NULL);
+  
+  std::vector<const Type*> Args;
+  Args.push_back(i32_type);
+  Args.push_back(PointerType::getUnqual(data_type));
+  Function *Main =
+    Function::Create(FunctionType::get(i32_type, Args, false),
+                     Function::ExternalLinkage, "main", M);
+  BasicBlock *Entry = BasicBlock::Create(Context, "entry", Main);
+  BasicBlock *Run = BasicBlock::Create(Context, "run", Main);
+  BasicBlock *Fail = BasicBlock::Create(Context, "fail", Main);
+  IRBuilder<> builder(Entry);
+  std::vector<Value*> MmapArgs;
+  MmapArgs.push_back(ConstantPointerNull::get(data_type));
+  MmapArgs.push_back(ConstantInt::get(int_type, tape_offset + TAPE_RESERVE));
+  MmapArgs.push_back(ConstantInt::get(i32_type, PROT_READ | PROT_WRITE));
+  MmapArgs.push_back(ConstantInt::get(i32_type, MAP_PRIVATE | MAP_ANONYMOUS |
+                                                MAP_NORESERVE));
+  MmapArgs.push_back(ConstantInt::get(i32_type, -1, true));
+  MmapArgs.push_back(ConstantInt::get(int_type, 0));
+  Value *Tape = builder.CreateCall(Mmap, MmapArgs.begin(), MmapArgs.end());
+  Value *Slot = builder.CreateAlloca(data_type);
+  builder.CreateCondBr(
+    builder.CreateICmpEQ(Tape,
+                         ConstantExpr::getIntToPtr(
+                           ConstantInt::get(int_type, -1, true), data_type)),
+    Fail, Run);
+  
+  builder.SetInsertPoint(Fail);
+  builder.CreateRet(ConstantInt::get(i32_type, 1));
+  
+  builder.SetInsertPoint(Run);
+  Value *OutputBuffer = M->getGlobalVariable("output_buffer", true);
+  Value *InputBuffer = M->getGlobalVariable("input_buffer", true);
+  Value *Begin = builder.CreateConstInBoundsGEP2_32(OutputBuffer, 0, 0);
+  builder.CreateStore(Begin, Tier->output_cur);
+  builder.CreateStore(builder.CreateConstInBoundsGEP2_32(OutputBuffer, 0,
+                                                         IO_BUF_SIZE),
+                      Tier->output_end);
+  Begin = builder.CreateConstInBoundsGEP2_32(InputBuffer, 0, 0);
+  builder.CreateStore(Begin, Tier->input_cur);
+  builder.CreateStore(Begin, Tier->input_end);
+  builder.CreateStore(builder.CreateConstInBoundsGEP1_32(Tape, tape_offset),
+                      Slot);
+  for (unsigned i = 0, e = pieces.size(); i != e; ++i)
+    builder.CreateCall2(pieces[i], ConstantInt::get(int_type, 0), Slot);
+  builder.CreateCall(Tier->flush_func, Slot);
+  builder.CreateRet(ConstantInt::get(i32_type, 0));
+}
+
+bool BrainFTraceRecorder::compile_program(const std::string &path,
+                                          size_t tape_offset) {
+  initialize_module();
+  BrainFJITTier AOT;
+  Tier = &AOT;
+  initialize_aot(AOT);
+
+  // Compile the loops in the order of their ']', which puts every inner
+  // loop before the loops around it.
+  for (size_t pc = 0; pc != VM->code_size; ++pc) {
+    if (VM->code[pc].opcode != OP_BACK)
+      continue;
+    size_t Begin = VM->code[pc].target;
+    BrainFTrace *Tree = build_tree(Begin, pc, true);
+    Function *F = compile_function(Tree);
+    F->setName("loop_" + utostr(Begin));
+    F->setLinkage(GlobalValue::InternalLinkage);
+    AOTLoops[Begin] = F;
+    delete Tree;
+  }
+
+  // Compile the code outside of any loop in pieces of at most AOT_CHUNK
+  // nodes, each ending where the next begins.
+  std::vector<Function*> Pieces;
+  size_t Begin = 0;
+  do {
+    size_t End = Begin;
+    for (unsigned n = 0; n != AOT_CHUNK && End != VM->code_size; ++n)
+      End = VM->code[End].opcode == OP_IF ? VM->code[End].target+1 : End+1;
+    BrainFTrace *Tree = build_tree(Begin, End, false);
+    Function *Piece = compile_function(Tree);
+    Piece->setName("program_" + utostr(Begin));
+    Piece->setLinkage(GlobalValue::InternalLinkage);
+    Pieces.push_back(Piece);
+    delete Tree;
+    Begin = End;
+  } while (Begin != VM->code_size);
+  compile_main(Pieces, tape_offset);
+
+  bool Written = emit_program(path);
+  AOTLoops.clear();
+  delete AOT.module;
+  return Written;
+}
@@ -10,50 +10,76 @@
 #include "BrainF.h"
 #include "BrainFVM.h"
 #include "llvm/Attributes.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/Support/StandardPasses.h"
+#include "llvm/System/Atomic.h"
+#include "llvm/System/Threading.h"
+#include "llvm/System/TimeValue.h"
 #include "llvm/Target/TargetData.h"
 #include "llvm/Target/TargetSelect.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/ADT/StringExtras.h"
+#include <algorithm>
 
-/// initialize_module - perform setup of the LLVM code generation system.
-void BrainFTraceRecorder::initialize_module() {
-  LLVMContext &Context = module->getContext();
-  
-  // Initialize the code generator, and enable aggressive code generation.
+namespace {
+  /// CodeSizeListener - Counts the bytes of machine code the JIT emits,
+  /// and keeps track of the most that is live at once.  It is shared by the
+  /// JITs of every VM.
+  class CodeSizeListener : public JITEventListener {
+    pthread_mutex_t Lock;
+    std::map<void*, size_t> Sizes;
+    uint64_t Live;
+  public:
+    CodeSizeListener() : Live(0) { pthread_mutex_init(&Lock, 0); }
+    
+    virtual void NotifyFunctionEmitted(const Function &F, void *Code,
+                                       size_t Size,
+                                       const EmittedFunctionDetails &Details) {
+      pthread_mutex_lock(&Lock);
+      Sizes[Code] = Size;
+      Stats.code_bytes += Size;
+      Live += Size;
+      if (Live > Stats.code_peak_bytes)
+        Stats.code_peak_bytes = Live;
+      pthread_mutex_unlock(&Lock);
+    }
+    
+    virtual void NotifyFreeingMachineCode(void *OldPtr) {
+      pthread_mutex_lock(&Lock);
+      std::map<void*, size_t>::iterator I = Sizes.find(OldPtr);
+      if (I != Sizes.end()) {
+        Live -= I->second;
+        Sizes.erase(I);
+      }
+      pthread_mutex_unlock(&Lock);
+    }
+    
+    /// size_of - The size of the live code at Code, or 0 if there is none.
+    size_t size_of(void *Code) {
+      pthread_mutex_lock(&Lock);
+      std::map<void*, size_t>::iterator I = Sizes.find(Code);
+      size_t Size = I == Sizes.end() ? 0 : I->second;
+      pthread_mutex_unlock(&Lock);
+      return Size;
+    }
+  };
+}
+
+static CodeSizeListener CodeSize;
+
+static pthread_once_t TargetOnce = PTHREAD_ONCE_INIT;
+
+/// initialize_target - Set up the native target, once for the process.  The
+/// recorders of several VMs may be compiling at once.
+static void initialize_target() {
+  llvm_start_multithreaded();
   InitializeNativeTarget();
-  EngineBuilder builder(module);
-  builder.setOptLevel(CodeGenOpt::Aggressive);
-  EE = builder.create();
-  
-  // Create a FunctionPassManager to handle running optimization passes
-  // on our generated code.  Setup a basic suite of optimizations for it.
-  FPM = new llvm::FunctionPassManager(module);
-  FPM->add(createInstructionCombiningPass());
-  FPM->add(createCFGSimplificationPass());
-  FPM->add(createScalarReplAggregatesPass());
-  FPM->add(createSimplifyLibCallsPass());
-  FPM->add(createInstructionCombiningPass());
-  FPM->add(createJumpThreadingPass());
-  FPM->add(createCFGSimplificationPass());
-  FPM->add(createInstructionCombiningPass());
-  FPM->add(createCFGSimplificationPass());
-  FPM->add(createReassociatePass());
-  FPM->add(createLoopRotatePass());
-  FPM->add(createLICMPass());
-  FPM->add(createLoopUnswitchPass(false));
-  FPM->add(createInstructionCombiningPass());  
-  FPM->add(createIndVarSimplifyPass());
-  FPM->add(createLoopDeletionPass());
-  FPM->add(createLoopUnrollPass());
-  FPM->add(createInstructionCombiningPass());
-  FPM->add(createGVNPass());
-  FPM->add(createSCCPPass());
-  FPM->add(createInstructionCombiningPass());
-  FPM->add(createJumpThreadingPass());
-  FPM->add(createDeadStoreEliminationPass());
-  FPM->add(createAggressiveDCEPass());
-  FPM->add(createCFGSimplificationPass());
+}
+
+/// initialize_module - perform setup of the LLVM code generation system
+/// shared by both tiers.
+void BrainFTraceRecorder::initialize_module() {
+  pthread_once(&TargetOnce, initialize_target);
   
   // Cache the LLVM type signature of an opcode function
   int_type = sizeof(size_t) == 4 ? 
@@ -63,70 +89,341 @@ void BrainFTraceRecorder::initialize_module() {
     PointerType::getUnqual(IntegerType::getInt8Ty(Context));
   std::vector<const Type*> args;
   args.push_back(int_type);
-  args.push_back(data_type);
-  op_type =
-    FunctionType::get(Type::getVoidTy(Context), args, false);
-  
-  // Setup a global variable in the LLVM module to represent the bytecode
-  // array.  Bind it to the actual bytecode array at JIT time.
-  const Type *bytecode_type = PointerType::getUnqual(op_type);
-  bytecode_array = cast<GlobalValue>(module->
-    getOrInsertGlobal("BytecodeArray", bytecode_type));
-  EE->addGlobalMapping(bytecode_array, BytecodeArray);
-  
-  // Setup a similar mapping for the global mode flag.
-  const IntegerType *flag_type = IntegerType::get(Context, 8);
-  mode_flag =
-    cast<GlobalValue>(module->getOrInsertGlobal("mode", flag_type));
-  EE->addGlobalMapping(mode_flag, &mode);
-  
-  // Setup a similar mapping for the global extension root flag.
-  ext_root =
-    cast<GlobalValue>(module->getOrInsertGlobal("ext_root", int_type));
-  EE->addGlobalMapping(ext_root, &extension_root);
+  args.push_back(PointerType::getUnqual(data_type));
+  op_type = FunctionType::get(int_type, args, false);
+}
+
+/// initialize_tier - Create the module, JIT and optimization pipeline of a
+/// tier.  Tier 1 is built for compile speed, tier 2 for code quality.
+void BrainFTraceRecorder::initialize_tier(BrainFJITTier &T, unsigned level) {
+  T.module = new Module(level == 1 ? "BrainF.tier1" : "BrainF.tier2", Context);
+  
+  // Initialize the code generator.  Tier 1 uses the fast instruction
+  // selector and register allocator, tier 2 aggressive code generation.
+  EngineBuilder builder(T.module);
+  builder.setOptLevel(level == 1 ? CodeGenOpt::None : CodeGenOpt::Aggressive);
+  T.EE = builder.create();
+  
+  // Compiled traces run on the interpreter thread, so they must not call
+  // back into the JIT to resolve functions lazily.
+  T.EE->DisableLazyCompilation();
+  T.EE->RegisterJITEventListener(&CodeSize);
+  
+  // Create a FunctionPassManager to handle running optimization passes
+  // on our generated code.  The trace compiler already folds pointer
+  // motion, combines updates to each cell and resolves the tests it knows
+  // the outcome of, so tier 1 need only merge the blocks it leaves behind.
+  // Tier 2 adds the loop optimizations, and the load and store forwarding
+  // across the iterations of the trace that are beyond the trace compiler.
+  FunctionPassManager *FPM = T.FPM = new FunctionPassManager(T.module);
+  FPM->add(createCFGSimplificationPass());
+  if (level != 1) {
+    FPM->add(createInstructionCombiningPass());
+    FPM->add(createReassociatePass());
+    FPM->add(createLoopRotatePass());
+    FPM->add(createLICMPass());
+    FPM->add(createLoopUnswitchPass(false));
+    FPM->add(createInstructionCombiningPass());
+    FPM->add(createIndVarSimplifyPass());
+    FPM->add(createLoopDeletionPass());
+    FPM->add(createLoopUnrollPass());
+    FPM->add(createGVNPass());
+    FPM->add(createInstructionCombiningPass());
+    FPM->add(createDeadStoreEliminationPass());
+    FPM->add(createAggressiveDCEPass());
+    FPM->add(createCFGSimplificationPass());
+  }
+  
+  // Setup a mapping for the global extension root flag.
+  T.ext_root =
+    cast<GlobalValue>(T.module->getOrInsertGlobal("ext_root", int_type));
+  T.EE->addGlobalMapping(T.ext_root, &extension_root);
   
   // Setup a similar mapping for the global extension leaf flag.
-  ext_leaf =
-    cast<GlobalValue>(module->getOrInsertGlobal("ext_leaf", int_type));
-  EE->addGlobalMapping(ext_leaf, &extension_leaf);
+  T.ext_leaf =
+    cast<GlobalValue>(T.module->getOrInsertGlobal("ext_leaf", int_type));
+  T.EE->addGlobalMapping(T.ext_leaf, &extension_leaf);
+
+  // Setup mappings for the VM's I/O buffers, and declare the functions that
+  // empty and refill them.  Those take the VM, which compiled code already
+  // has: its data pointer is the VM's first field.
+  const Type *data_type =
+    PointerType::getUnqual(IntegerType::getInt8Ty(Context));
+  T.output_cur =
+    cast<GlobalValue>(T.module->getOrInsertGlobal("output_cur", data_type));
+  T.EE->addGlobalMapping(T.output_cur, &VM->output_cur);
+  T.output_end =
+    cast<GlobalValue>(T.module->getOrInsertGlobal("output_end", data_type));
+  T.EE->addGlobalMapping(T.output_end, &VM->output_end);
+  T.input_cur =
+    cast<GlobalValue>(T.module->getOrInsertGlobal("input_cur", data_type));
+  T.EE->addGlobalMapping(T.input_cur, &VM->input_cur);
+  T.input_end =
+    cast<GlobalValue>(T.module->getOrInsertGlobal("input_end", data_type));
+  T.EE->addGlobalMapping(T.input_end, &VM->input_end);
+  
+  // And for the bounds of the tape, which safe mode checks against.
+  T.tape_begin =
+    cast<GlobalValue>(T.module->getOrInsertGlobal("tape_begin", data_type));
+  T.EE->addGlobalMapping(T.tape_begin, &VM->tape.begin);
+  T.tape_end =
+    cast<GlobalValue>(T.module->getOrInsertGlobal("tape_end", data_type));
+  T.EE->addGlobalMapping(T.tape_end, &VM->tape.end);
+  
+  const Type *vm_type = PointerType::getUnqual(data_type);
+  T.flush_func =
+    T.module->getOrInsertFunction("brainf_flush", data_type, vm_type, NULL);
+  T.EE->addGlobalMapping(cast<GlobalValue>(T.flush_func),
+                         (void*)&brainf_flush);
+  T.refill_func =
+    T.module->getOrInsertFunction("brainf_refill",
+                                  IntegerType::getInt8Ty(Context), vm_type,
+                                  NULL);
+  T.EE->addGlobalMapping(cast<GlobalValue>(T.refill_func),
+                         (void*)&brainf_refill);
+  
+  // Declare the scan kernel shared with the interpreter, and bind it to the
+  // interpreter's copy.
+  T.scan_func = T.module->getOrInsertFunction("brainf_scan", data_type,
+                                              data_type,
+                                              IntegerType::getInt32Ty(Context),
+                                              NULL);
+  T.EE->addGlobalMapping(cast<GlobalValue>(T.scan_func),
+                         (void*)&brainf_scan);
+  
+  // Declare the hook through which tier 1 code asks for its recompilation.
+  T.promote_func =
+    T.module->getOrInsertFunction("brainf_promote", Type::getVoidTy(Context),
+                                  int_type, int_type, NULL);
+  T.EE->addGlobalMapping(cast<GlobalValue>(T.promote_func),
+                         (void*)&BrainFTraceRecorder::promote);
+}
+
+void BrainFTraceRecorder::compile(BrainFTrace* trace) {
+  // Bring up the tier the tree is to be compiled in, the first time it is
+  // used.
+  if (!op_type)
+    initialize_module();
+  Tier = &tiers[trace->tier-1];
+  if (!Tier->EE)
+    initialize_tier(*Tier, trace->tier);
+  
+  Slots = new std::map<uint32_t, void*>();
+  Function *curr_func = compile_function(trace);
 
-  // Cache LLVM declarations for putchar() and getchar().
-  const Type *int_type = sizeof(int) == 4 ? IntegerType::getInt32Ty(Context)
-                                       : IntegerType::getInt64Ty(Context);
-  putchar_func =
-    module->getOrInsertFunction("putchar", int_type, int_type, NULL);
-  getchar_func = module->getOrInsertFunction("getchar", int_type, NULL);
+  // Run out optimization suite on our newly generated trace.
+  sys::TimeValue Start = sys::TimeValue::now();
+  Tier->FPM->run(*curr_func);
+  sys::TimeValue Optimized = sys::TimeValue::now();
+  uint64_t OptimizeUsec = (Optimized - Start).usec();
+  Stats.optimize_usec += OptimizeUsec;
+  
+  // Compile our trace to machine code, and install function pointer to it
+  // into the trace array, replacing the opcode at the trace head so that it
+  // will be executed every time the trace-head PC is reached.  The
+  // interpreter is running concurrently, so the trace must be visible
+  // before the opcode that dispatches to it.  The version it replaces, if
+  // any, is retired.
+  void *code = Tier->EE->getPointerToFunction(curr_func);
+  uint64_t CodegenUsec = (sys::TimeValue::now() - Optimized).usec();
+  Stats.codegen_usec += CodegenUsec;
+  if (!Stats.first_trace_usec)
+    Stats.first_trace_usec = sys::TimeValue::now().usec() - Stats.start_usec;
+  if (trace->tier == 1)
+    ++Stats.tier1_compiles;
+  else
+    ++Stats.tier2_compiles;
+  void *old_code = (void*)(intptr_t)VM->traces[trace->root().pc];
+  VM->traces[trace->root().pc] = (opcode_func_t)(intptr_t)code;
+  sys::MemoryFence();
+  VM->code[trace->root().pc].opcode = OP_TRACE;
+  size_t Bytes = CodeSize.size_of(code);
+  brainf_profile_code(VM, trace->root().pc, "trace", code, Bytes);
+  brainf_stats_compile(trace->root().pc, OptimizeUsec, CodegenUsec, Bytes);
+  
+  BrainFCompiledTrace &Record = compiled[trace->original];
+  Record.root = add_version(curr_func, code, old_code);
+  Record.root->slots = Slots;
+  Record.branches = 0;
+  Slots = 0;
 }
 
-void BrainFTraceRecorder::compile(BrainFTraceNode* trace) {
-  LLVMContext &Context = module->getContext();
+/// compile_branches - Compile the paths added to a tree since it was last
+/// compiled as branches of the code already installed for it, which its
+/// side exits jump to, rather than recompiling the whole tree.  The cost of
+/// an extension is then only that of its own nodes.  Returns false if the
+/// whole tree should be recompiled instead: when it is moving to tier 2,
+/// when MAX_BRANCHES have piled up on it, or when a path was added to an
+/// exit that does not jump through a slot, such as one from a call.
+bool BrainFTraceRecorder::compile_branches(BrainFTrace *trace,
+                                           BrainFCompiledTrace &record) {
+  BrainFTrace *Old = record.snapshot;
+  if (!record.root || !Old || Old->tier != trace->tier)
+    return false;
+  
+  // Find the edges that were side exits when the tree was last compiled,
+  // and that lead to new nodes now.
+  std::vector<std::pair<uint32_t, uint32_t> > Grafts;
+  for (uint32_t i = 0, e = Old->nodes.size(); i != e; ++i) {
+    const BrainFTraceNode &Was = Old->nodes[i], &Now = trace->nodes[i];
+    if (Was.left == Now.left && Was.right == Now.right)
+      continue;
+    if (Was.opcode != '[' || (Was.left != Now.left && Was.right != Now.right))
+      return false;
+    std::map<uint32_t, void*>::iterator Slot = record.root->slots->find(i);
+    if (Slot == record.root->slots->end() || Slot->second)
+      return false;
+    Grafts.push_back(std::make_pair(i, Was.left != Now.left ? Now.left
+                                                            : Now.right));
+  }
+  if (Grafts.empty() || record.branches + Grafts.size() > MAX_BRANCHES)
+    return false;
+  
+  for (unsigned i = 0, e = Grafts.size(); i != e; ++i) {
+    const BrainFTraceNode &Leaf = trace->nodes[Grafts[i].first];
+    size_t exit_pc = Grafts[i].second == Leaf.left
+                       ? Leaf.pc+1 : VM->code[Leaf.pc].target+1;
+    compile_branch(trace, record, Grafts[i].first, Grafts[i].second, exit_pc);
+  }
+  return true;
+}
+
+/// compile_branch - Compile the part of trace reached through link, which
+/// grew from the side exit of the node at leaf to exit_pc, and install it
+/// in that exit's slot.
+void BrainFTraceRecorder::compile_branch(BrainFTrace *trace,
+                                         BrainFCompiledTrace &record,
+                                         uint32_t leaf, uint32_t link,
+                                         size_t exit_pc) {
+  Tier = &tiers[trace->tier-1];
+  Slots = record.root->slots;
+  Function *F = compile_branch_function(trace, link, exit_pc);
+  
+  sys::TimeValue Start = sys::TimeValue::now();
+  Tier->FPM->run(*F);
+  sys::TimeValue Optimized = sys::TimeValue::now();
+  uint64_t OptimizeUsec = (Optimized - Start).usec();
+  Stats.optimize_usec += OptimizeUsec;
+  void *code = Tier->EE->getPointerToFunction(F);
+  uint64_t CodegenUsec = (sys::TimeValue::now() - Optimized).usec();
+  Stats.codegen_usec += CodegenUsec;
+  ++Stats.branch_compiles;
+  
+  // The branch's one link is from the tree, which keeps it alive.
+  BrainFCodeVersion *Branch = add_version(F, code, 0);
+  record.root->callees.push_back(Branch);
+  ++record.branches;
+  record.unlinked_exits.insert(record.unlinked_exits.end(),
+                               UnlinkedExits.begin(), UnlinkedExits.end());
+  Slots = 0;
+  
+  sys::MemoryFence();
+  (*record.root->slots)[leaf] = code;
+  size_t Bytes = CodeSize.size_of(code);
+  brainf_profile_code(VM, exit_pc, "branch", code, Bytes);
+  brainf_stats_compile(trace->root().pc, OptimizeUsec, CodegenUsec, Bytes);
+}
+
+/// add_version - Record the version of trace code just installed in place
+/// of old_code, which is retired unless other traces still call it.
+BrainFTraceRecorder::BrainFCodeVersion *
+BrainFTraceRecorder::add_version(Function *function, void *code,
+                                 void *old_code) {
+  BrainFCodeVersion *Version = new BrainFCodeVersion(function, code);
+  for (std::vector<void*>::iterator I = Callees.begin(), E = Callees.end();
+       I != E; ++I) {
+    BrainFCodeVersion *Callee = versions.lookup(*I);
+    ++Callee->links;
+    Version->callees.push_back(Callee);
+  }
+  versions[code] = Version;
+  if (old_code)
+    release(versions.lookup(old_code));
+  return Version;
+}
+
+/// release - Drop a link to version, and retire it if that was the last.
+/// It can no longer be entered, but the interpreter may still be running
+/// it, so it is only freed once the interpreter has returned to its
+/// dispatch loop.
+void BrainFTraceRecorder::release(BrainFCodeVersion *version) {
+  if (--version->links)
+    return;
+  version->retired_at = ++VM->retire_epoch;
+  retired.push_back(version);
+}
+
+/// free_version - Free the machine code and IR of version, and forget it.
+void BrainFTraceRecorder::free_version(BrainFCodeVersion *version) {
+  Function *F = version->function;
+  ExecutionEngine *EE =
+    F->getParent() == tiers[0].module ? tiers[0].EE : tiers[1].EE;
+  versions.erase(version->code);
+  EE->freeMachineCodeForFunction(F);
+  F->eraseFromParent();
+  delete version->slots;
+}
+
+/// reclaim - Free the machine code and IR of the retired versions that the
+/// interpreter has left, and release the versions they call.  Runs on the
+/// compiler thread, which owns the JITs.
+void BrainFTraceRecorder::reclaim() {
+  size_t Quiescent = VM->quiescent_epoch;
+  std::vector<BrainFCodeVersion*> Freed;
+  for (std::vector<BrainFCodeVersion*>::iterator I = retired.begin();
+       I != retired.end(); ) {
+    if ((*I)->retired_at > Quiescent) {
+      ++I;
+      continue;
+    }
+    Freed.push_back(*I);
+    I = retired.erase(I);
+  }
+  
+  for (std::vector<BrainFCodeVersion*>::iterator I = Freed.begin(),
+       E = Freed.end(); I != E; ++I) {
+    BrainFCodeVersion *Version = *I;
+    free_version(Version);
+    ++Stats.traces_freed;
+    
+    for (std::vector<BrainFCodeVersion*>::iterator
+         C = Version->callees.begin(), CE = Version->callees.end();
+         C != CE; ++C)
+      release(*C);
+    delete Version;
+  }
+}
+
+/// compile_function - Generate the unoptimized IR for a trace tree, as a
+/// new function of op_type in the module of the current tier.
+Function *BrainFTraceRecorder::compile_function(BrainFTrace *trace) {
   
   // Create a new function for the trace we're compiling.
   Function *curr_func =  
-    Function::Create(op_type, Function::ExternalLinkage, "", module);
+    Function::Create(op_type, Function::ExternalLinkage, "", Tier->module);
   
   // Create an entry block, which branches directly to a header block.
   // This is necessary because the entry block cannot be the target of
   // a loop.
   BasicBlock *Entry = BasicBlock::Create(Context, "entry", curr_func);
-  Header = BasicBlock::Create(Context, utostr(trace->pc), curr_func);
+  Header = BasicBlock::Create(Context, utostr(trace->root().pc), curr_func);
   
-  // Mark the array pointer as noalias, and setup compiler state.
+  // Mark the data pointer slot as noalias, and setup compiler state.  The
+  // data pointer is loaded once on entry and kept in a register; it is only
+  // written back when the trace exits.
   IRBuilder<> builder(Entry);
   Argument *Arg1 = ++curr_func->arg_begin();
   Arg1->addAttr(Attribute::NoAlias);
-  DataPtr = Arg1;
-  
-  // Emit code to set the mode flag.  This signals to the recorder
-  // that the preceding opcode was executed as a part of a compiled trace.
-  const IntegerType *flag_type = IntegerType::get(Context, 8);
-  ConstantInt *Mode = ConstantInt::get(flag_type, MODE_EXTENSION_BEGIN);
-  builder.CreateStore(Mode, mode_flag);
-  
-  // Emit code to set the extension root, which is a pointer to the
-  // root of the trace tree.
-  ConstantInt *ExtRoot = ConstantInt::get(int_type, (intptr_t)trace);
-  builder.CreateStore(ExtRoot, ext_root);
+  DataArg = Arg1;
+  DataPtr = builder.CreateLoad(DataArg);
+  OutputReserved = 0;
+  UnlinkedExits.clear();
+  Callees.clear();
+  
+  // The extension root, which is a pointer to the live trace tree, is only
+  // set on the way out of the trace, so that entering it costs nothing
+  // beyond loading the data pointer.
+  ExtRoot = ConstantInt::get(int_type, (intptr_t)trace->original);
   builder.CreateBr(Header);
   
   // Header will be the root of our trace tree.  As such, all loop back-edges
@@ -135,228 +432,762 @@ void BrainFTraceRecorder::compile(BrainFTraceNode* trace) {
   builder.SetInsertPoint(Header);
   HeaderPHI = builder.CreatePHI(DataPtr->getType());
   HeaderPHI->addIncoming(DataPtr, Entry);
-  DataPtr = HeaderPHI;
   
-  // Recursively descend the trace tree, emitting code for the opcodes as we go.
-  compile_opcode(trace, builder);
+  // Nothing is known about the tape at the top of an iteration, since every
+  // path back to the header writes back what it knew.
+  Nodes = &trace->nodes[0];
+  reset_cells(HeaderPHI);
+  
+  // In safe mode, check that the iteration stays on the tape before running
+  // any of it, or else hand the whole loop back to the interpreter.
+  compile_range_check(0, trace->root().pc, builder);
+  
+  // In tier 1, count the iterations of the tree, and have it promoted to
+  // tier 2 the moment it reaches the threshold.
+  if (trace->tier == 1) {
+    const Type *count_type = IntegerType::getInt32Ty(Context);
+    Value *CountPtr = builder.CreateIntToPtr(
+      ConstantInt::get(int_type, (intptr_t)&trace->original->iterations),
+      PointerType::getUnqual(count_type));
+    Value *Count = builder.CreateAdd(builder.CreateLoad(CountPtr),
+                                     ConstantInt::get(count_type, 1));
+    builder.CreateStore(Count, CountPtr);
+    
+    BasicBlock *Promote = BasicBlock::Create(Context, "promote", curr_func);
+    BasicBlock *Body = BasicBlock::Create(Context, "", curr_func);
+    builder.CreateCondBr(
+      builder.CreateICmpEQ(Count, ConstantInt::get(count_type,
+                                                   TIER2_THRESHOLD)),
+      Promote, Body);
+    
+    builder.SetInsertPoint(Promote);
+    builder.CreateCall2(Tier->promote_func,
+                        ConstantInt::get(int_type, (intptr_t)this),
+                        ConstantInt::get(int_type, (intptr_t)trace->original));
+    builder.CreateBr(Body);
+    builder.SetInsertPoint(Body);
+  }
+  
+  // Descend the trace tree, emitting code for the opcodes as we go.
+  compile_opcode(&Nodes[0], builder);
+  return curr_func;
+}
 
-  // Run out optimization suite on our newly generated trace.
-  FPM->run(*curr_func);
+/// compile_branch_function - Generate the unoptimized IR for the part of a
+/// tree reached through link, which the side exit to exit_pc jumps to once
+/// it is installed.  The branch is entered with the tape up to date.  It
+/// leaves like the tree would, except that where the tree would loop, the
+/// branch returns the pc of the head to it, and the tree loops.
+Function *BrainFTraceRecorder::compile_branch_function(BrainFTrace *trace,
+                                                       uint32_t link,
+                                                       size_t exit_pc) {
+  Function *curr_func =
+    Function::Create(op_type, Function::ExternalLinkage, "", Tier->module);
+  BasicBlock *Entry = BasicBlock::Create(Context, "entry", curr_func);
+  Header = BasicBlock::Create(Context, "return", curr_func);
   
-  // Compile our trace to machine code, and install function pointer to it
-  // into the bytecode array so that it will be executed every time the 
-  // trace-head PC is reached.
-  void *code = EE->getPointerToFunction(curr_func);
-  BytecodeArray[trace->pc] =
-    (opcode_func_t)(intptr_t)code;
+  IRBuilder<> builder(Entry);
+  Argument *Arg1 = ++curr_func->arg_begin();
+  Arg1->addAttr(Attribute::NoAlias);
+  DataArg = Arg1;
+  DataPtr = builder.CreateLoad(DataArg);
+  OutputReserved = 0;
+  UnlinkedExits.clear();
+  Callees.clear();
+  ExtRoot = ConstantInt::get(int_type, (intptr_t)trace->original);
+  Nodes = &trace->nodes[0];
+  
+  // Every path back to the head ends up here, to hand the data pointer
+  // back to the tree.
+  builder.SetInsertPoint(Header);
+  HeaderPHI = builder.CreatePHI(DataPtr->getType());
+  builder.CreateStore(HeaderPHI, DataArg);
+  builder.CreateRet(ConstantInt::get(int_type, trace->root().pc));
+  
+  builder.SetInsertPoint(Entry);
+  reset_cells(DataPtr);
+  if (link != TRACE_HEAD)
+    compile_range_check(link, exit_pc, builder);
+  compile_link(link, builder);
+  return curr_func;
 }
 
-/// compile_plus - Emit code for '+'
-void BrainFTraceRecorder::compile_plus(BrainFTraceNode *node,
-                                       IRBuilder<>& builder) {
-  Value *CellValue = builder.CreateLoad(DataPtr);
-  Constant *One =
-    ConstantInt::get(IntegerType::getInt8Ty(Header->getContext()), 1);
-  Value *UpdatedValue = builder.CreateAdd(CellValue, One);
-  builder.CreateStore(UpdatedValue, DataPtr);
-  
-  if (node->left != (BrainFTraceNode*)~0ULL)
-    compile_opcode(node->left, builder);
-  else {
-    HeaderPHI->addIncoming(DataPtr, builder.GetInsertBlock());
-    builder.CreateBr(Header);
+/// data_ptr - Materialize the data pointer at the current point of the path.
+Value *BrainFTraceRecorder::data_ptr(IRBuilder<>& builder) {
+  if (!Offset)
+    return DataPtr;
+  return builder.CreateConstInBoundsGEP1_32(DataPtr, Offset);
+}
+
+/// load_cell - Return the current value of the cell at offset from DataPtr,
+/// loading it and applying its pending adds if that has not been done yet.
+Value *BrainFTraceRecorder::load_cell(int32_t offset, IRBuilder<>& builder) {
+  BrainFCell &Cell = Cells[offset];
+  if (!Cell.value) {
+    Value *CellPtr =
+      offset ? builder.CreateConstInBoundsGEP1_32(DataPtr, offset) : DataPtr;
+    Cell.value = builder.CreateLoad(CellPtr);
+  }
+  
+  // Once the adds are folded into the value, only dirty remembers that
+  // memory no longer holds it.
+  if (Cell.delta) {
+    Cell.value = builder.CreateAdd(Cell.value,
+      ConstantInt::get(IntegerType::getInt8Ty(Header->getContext()),
+                       Cell.delta));
+    Cell.delta = 0;
+    Cell.dirty = true;
   }
+  return Cell.value;
 }
 
-/// compile_minus - Emit code for '-'   
-void BrainFTraceRecorder::compile_minus(BrainFTraceNode *node,
-                                        IRBuilder<>& builder) {
-  Value *CellValue = builder.CreateLoad(DataPtr);
-  Constant *One =
-    ConstantInt::get(IntegerType::getInt8Ty(Header->getContext()), 1);
-  Value *UpdatedValue = builder.CreateSub(CellValue, One);
-  builder.CreateStore(UpdatedValue, DataPtr);
-  
-  if (node->left != (BrainFTraceNode*)~0ULL)
-    compile_opcode(node->left, builder);
-  else {
-    HeaderPHI->addIncoming(DataPtr, builder.GetInsertBlock());
-    builder.CreateBr(Header);
+/// flush_cell - Write the cell at offset from DataPtr back to the tape, if
+/// the tape does not hold its current value.
+void BrainFTraceRecorder::flush_cell(int32_t offset, IRBuilder<>& builder) {
+  std::map<int32_t, BrainFCell>::iterator I = Cells.find(offset);
+  if (I == Cells.end() || (!I->second.dirty && !I->second.delta))
+    return;
+  Value *CellValue = load_cell(offset, builder);
+  builder.CreateStore(CellValue,
+                      offset ? builder.CreateConstInBoundsGEP1_32(DataPtr,
+                                                                  offset)
+                             : DataPtr);
+  I->second.dirty = false;
+}
+
+/// flush_cells - Write every cell the tape is out of date on back to it.
+void BrainFTraceRecorder::flush_cells(IRBuilder<>& builder) {
+  for (std::map<int32_t, BrainFCell>::iterator I = Cells.begin(),
+       E = Cells.end(); I != E; ++I)
+    flush_cell(I->first, builder);
+}
+
+/// reset_cells - Forget everything known about the tape, which from here
+/// on is addressed relative to ptr.
+void BrainFTraceRecorder::reset_cells(Value *ptr) {
+  DataPtr = ptr;
+  Offset = 0;
+  Cells.clear();
+}
+
+/// offset_range - Find the lowest and highest offsets from where it is at
+/// node that the data pointer moves to along any path of the tree from
+/// there, up to the head, a scan or a call.  Those move it by an unknown
+/// amount, so the rest of the path is checked after them.
+void BrainFTraceRecorder::offset_range(uint32_t node, int32_t &lo,
+                                       int32_t &hi) {
+  lo = hi = 0;
+  std::vector<std::pair<uint32_t, int32_t> > Worklist;
+  Worklist.push_back(std::make_pair(node, 0));
+  while (!Worklist.empty()) {
+    BrainFTraceNode &N = Nodes[Worklist.back().first];
+    int32_t Off = Worklist.back().second;
+    Worklist.pop_back();
+    
+    if (N.opcode == '>')
+      Off += VM->code[N.pc].value;
+    lo = std::min(lo, Off);
+    hi = std::max(hi, Off);
+    if (N.opcode == 's' || N.opcode == 'T')
+      continue;
+    
+    // Any node may have its successor on the right, as a ']' does, so
+    // both links are followed.
+    if (N.left != UNTRACED && N.left != TRACE_HEAD)
+      Worklist.push_back(std::make_pair(N.left, Off));
+    if (N.right != UNTRACED && N.right != TRACE_HEAD)
+      Worklist.push_back(std::make_pair(N.right, Off));
   }
 }
-                                          
-/// compile_left - Emit code for '<'                                  
-void BrainFTraceRecorder::compile_left(BrainFTraceNode *node,
-                                       IRBuilder<>& builder) {
-  Value *OldPtr = DataPtr;
-  DataPtr = builder.CreateConstInBoundsGEP1_32(DataPtr, -1);
-  if (node->left != (BrainFTraceNode*)~0ULL)
-    compile_opcode(node->left, builder);
-  else {
-    HeaderPHI->addIncoming(DataPtr, builder.GetInsertBlock());
-    builder.CreateBr(Header);
+
+/// compile_range_check - In safe mode, emit a check that the data pointer
+/// stays on the tape along every path from node, and if it would not, leave
+/// the trace at exit_pc without running any of them.  Every instruction
+/// reaches at most MAX_OFFSET cells from the data pointer, so the guard
+/// pages catch the rest.  The tape must be up to date here.
+void BrainFTraceRecorder::compile_range_check(uint32_t node, size_t exit_pc,
+                                              IRBuilder<>& builder) {
+  if (!VM->safe)
+    return;
+  
+  int32_t Lo, Hi;
+  offset_range(node, Lo, Hi);
+  
+  Value *Ptr = builder.CreatePtrToInt(DataPtr, int_type);
+  Value *Begin = builder.CreatePtrToInt(builder.CreateLoad(Tier->tape_begin),
+                                        int_type);
+  Value *End = builder.CreatePtrToInt(builder.CreateLoad(Tier->tape_end),
+                                      int_type);
+  Value *OnTape = builder.CreateAnd(
+    builder.CreateICmpUGE(
+      builder.CreateAdd(Ptr, ConstantInt::get(int_type, Lo, true)), Begin),
+    builder.CreateICmpULT(
+      builder.CreateAdd(Ptr, ConstantInt::get(int_type, Hi, true)), End));
+  
+  BasicBlock *Refuse = BasicBlock::Create(Context,
+                                          "off_tape_"+utostr(exit_pc),
+                                          Header->getParent());
+  BasicBlock *Body = BasicBlock::Create(Context, "", Header->getParent());
+  builder.CreateCondBr(OnTape, Body, Refuse);
+  
+  // A null extension root tells the recorder not to extend from here.
+  builder.SetInsertPoint(Refuse);
+  builder.CreateStore(DataPtr, DataArg);
+  builder.CreateStore(ConstantInt::get(int_type, 0), Tier->ext_root);
+  builder.CreateRet(ConstantInt::get(int_type, exit_pc));
+  
+  builder.SetInsertPoint(Body);
+}
+
+/// compile_link - Emit code for the node at link, or for a branch back to
+/// the trace head if that is where the link goes.  Every compile_* function
+/// ends by linking to the node after it, so while a path is being compiled
+/// the link is only noted, and the loop in compile_path compiles that node
+/// next.  A path of any length is then compiled without recursing once per
+/// node.
+void BrainFTraceRecorder::compile_link(uint32_t link, IRBuilder<>& builder) {
+  if (link != TRACE_HEAD) {
+    if (Walking)
+      NextLink = link;
+    else
+      compile_path(link, builder);
+    return;
   }
-  DataPtr = OldPtr;
+  
+  flush_cells(builder);
+  HeaderPHI->addIncoming(data_ptr(builder), builder.GetInsertBlock());
+  builder.CreateBr(Header);
 }
 
-/// compile_right - Emit code for '>'                                                                               
-void BrainFTraceRecorder::compile_right(BrainFTraceNode *node,
+/// compile_path - Emit code for the node at link and the rest of the path
+/// from it, one node after another.
+void BrainFTraceRecorder::compile_path(uint32_t link, IRBuilder<>& builder) {
+  bool WasWalking = Walking;
+  Walking = true;
+  while (link != UNTRACED) {
+    NextLink = UNTRACED;
+    compile_opcode(&Nodes[link], builder);
+    link = NextLink;
+  }
+  Walking = WasWalking;
+}
+
+/// compile_edge - Emit code for an edge out of node, which either leads to
+/// link or, if it was never traced, leaves the trace at exit_pc.
+void BrainFTraceRecorder::compile_edge(BrainFTraceNode *node, uint32_t link,
+                                       size_t exit_pc, IRBuilder<>& builder) {
+  if (link == UNTRACED)
+    compile_exit(node, exit_pc, builder);
+  else
+    compile_link(link, builder);
+}
+
+/// compile_child - Emit code for an edge out of node as compile_edge does,
+/// but compile the whole path along it before returning, so that the caller
+/// can go on to emit the other edges of node.
+void BrainFTraceRecorder::compile_child(BrainFTraceNode *node, uint32_t link,
+                                        size_t exit_pc,
                                         IRBuilder<>& builder) {
-  Value *OldPtr = DataPtr;
-  DataPtr = builder.CreateConstInBoundsGEP1_32(DataPtr, 1);
-  if (node->left != (BrainFTraceNode*)~0ULL)
-    compile_opcode(node->left, builder);
-  else {
-    HeaderPHI->addIncoming(DataPtr, builder.GetInsertBlock());
-    builder.CreateBr(Header);
+  bool WasWalking = Walking;
+  Walking = false;
+  compile_edge(node, link, exit_pc, builder);
+  Walking = WasWalking;
+}
+
+/// compile_add - Emit code for '+', a folded add of a constant to the cell
+/// at a constant offset from the data pointer.  Nothing is emitted until
+/// the cell is read or written back, so every add to a cell between two of
+/// those folds into one.
+void BrainFTraceRecorder::compile_add(BrainFTraceNode *node,
+                                      IRBuilder<>& builder) {
+  const BrainFInsn &Insn = VM->code[node->pc];
+  BrainFCell &Cell = Cells[Offset + Insn.offset];
+  Cell.delta += (uint8_t)Insn.value;
+  Cell.nonzero = false;
+  compile_link(node->left, builder);
+}
+
+/// compile_move - Emit code for '>', a folded move of the data pointer.
+/// The move only changes the offset at which later cells are addressed.
+void BrainFTraceRecorder::compile_move(BrainFTraceNode *node,
+                                       IRBuilder<>& builder) {
+  Offset += VM->code[node->pc].value;
+  compile_link(node->left, builder);
+}
+
+/// compile_mul - Emit code for a run of '*', the multiply-accumulates of a
+/// rewritten multiply/copy loop.  The loop did not run its body at all when
+/// its counter was zero, and the cells it targets may then lie off the end
+/// of the tape, so unless the counter is known not to be zero, the whole
+/// run is skipped in that case.  The skipped run works on the tape
+/// directly, as what is known about its targets depends on the path taken.
+void BrainFTraceRecorder::compile_mul(BrainFTraceNode *node,
+                                      IRBuilder<>& builder) {
+  LLVMContext &Context = Header->getContext();
+  Value *Counter = load_cell(Offset, builder);
+  ConstantInt *Known = dyn_cast<ConstantInt>(Counter);
+  bool Guarded = !Known && !Cells[Offset].nonzero;
+  
+  BrainFTraceNode *Last = node;
+  while (Last->left != TRACE_HEAD && Nodes[Last->left].opcode == '*')
+    Last = &Nodes[Last->left];
+  
+  if (Known && Known->isZero()) {
+    compile_link(Last->left, builder);
+    return;
+  }
+  
+  BasicBlock *Done = 0;
+  if (Guarded) {
+    for (BrainFTraceNode *N = node; ; N = &Nodes[N->left]) {
+      int32_t Target = Offset + VM->code[N->pc].offset;
+      flush_cell(Target, builder);
+      Cells.erase(Target);
+      if (N == Last) break;
+    }
+    
+    BasicBlock *Mul = BasicBlock::Create(Context, "mul_"+utostr(node->pc),
+                                         Header->getParent());
+    Done = BasicBlock::Create(Context, "", Header->getParent());
+    builder.CreateCondBr(
+      builder.CreateICmpEQ(Counter, ConstantInt::get(Counter->getType(), 0)),
+      Done, Mul);
+    builder.SetInsertPoint(Mul);
   }
-  DataPtr = OldPtr;
+  
+  for (BrainFTraceNode *N = node; ; N = &Nodes[N->left]) {
+    const BrainFInsn &Insn = VM->code[N->pc];
+    Constant *Factor =
+      ConstantInt::get(IntegerType::getInt8Ty(Context),
+                       (uint8_t)Insn.value);
+    Value *Product = builder.CreateMul(Counter, Factor);
+    int32_t Target = Offset + Insn.offset;
+    if (Guarded) {
+      Value *CellPtr = builder.CreateConstInBoundsGEP1_32(DataPtr, Target);
+      builder.CreateStore(builder.CreateAdd(builder.CreateLoad(CellPtr),
+                                            Product),
+                          CellPtr);
+    } else {
+      Value *CellValue = load_cell(Target, builder);
+      BrainFCell &Cell = Cells[Target];
+      Cell.value = builder.CreateAdd(CellValue, Product);
+      Cell.dirty = true;
+      Cell.nonzero = false;
+    }
+    if (N == Last) break;
+  }
+  
+  if (Guarded) {
+    builder.CreateBr(Done);
+    builder.SetInsertPoint(Done);
+  }
+  compile_link(Last->left, builder);
 }
- 
- 
-/// compile_put - Emit code for '.'                                                                                                                                                         
+
+/// compile_scan - Emit code for 's', a scan for the next zero cell along a
+/// constant stride.  The scan reads the tape and moves the data pointer by
+/// an unknown amount, so the tape is written back first and nothing is
+/// known afterwards but that the cell found is zero.
+void BrainFTraceRecorder::compile_scan(BrainFTraceNode *node,
+                                       IRBuilder<>& builder) {
+  flush_cells(builder);
+  Constant *Stride =
+    ConstantInt::get(IntegerType::getInt32Ty(Header->getContext()),
+                     VM->code[node->pc].value, true);
+  CallInst *Call = builder.CreateCall2(Tier->scan_func, data_ptr(builder),
+                                       Stride);
+  Call->setDoesNotThrow();
+  reset_cells(Call);
+  if (node->left != TRACE_HEAD)
+    compile_range_check(node->left, node->pc+1, builder);
+  Cells[0].value =
+    ConstantInt::get(IntegerType::getInt8Ty(Header->getContext()), 0);
+  compile_link(node->left, builder);
+}
+
+/// count_puts - Count the '.' nodes in the straight-line run of the trace
+/// beginning at node, which ends at the first branch, input, loop back-edge,
+/// scan, call or return to the trace head.  The whole run can share one
+/// check for room in the output buffer.  A scan ends it because in safe mode
+/// the trace may leave after one, without writing back the buffer position.
+/// The buffer only ever has room for IO_BUF_SIZE bytes, so a longer run is
+/// cut short there, and the rest makes room for itself.
+unsigned BrainFTraceRecorder::count_puts(BrainFTraceNode *node) {
+  unsigned Count = 0;
+  for (;;) {
+    if (node->opcode == '.') {
+      if (++Count == IO_BUF_SIZE)
+        break;
+    } else if (node->opcode == '[' || node->opcode == ']' ||
+               node->opcode == ',' || node->opcode == 'T' ||
+               node->opcode == 's') {
+      break;
+    }
+    if (node->left == UNTRACED || node->left == TRACE_HEAD)
+      break;
+    node = &Nodes[node->left];
+  }
+  return Count;
+}
+
+/// compile_put - Emit code for '.', an append to the VM's output buffer.
+/// The first '.' of a run makes room in the buffer for the whole run,
+/// flushing it if necessary, and the last one writes back the buffer
+/// position.
 void BrainFTraceRecorder::compile_put(BrainFTraceNode *node,
                                       IRBuilder<>& builder) {
-  Value *Loaded = builder.CreateLoad(DataPtr);
-  Value *Print =
-    builder.CreateSExt(Loaded, IntegerType::get(Loaded->getContext(), 32));
-  builder.CreateCall(putchar_func, Print);
-  if (node->left != (BrainFTraceNode*)~0ULL)
-    compile_opcode(node->left, builder);
-  else {
-    HeaderPHI->addIncoming(DataPtr, builder.GetInsertBlock());
-    builder.CreateBr(Header);
+  if (!OutputReserved) {
+    LLVMContext &Context = Header->getContext();
+    Function *Func = Header->getParent();
+    OutputReserved = count_puts(node);
+    
+    Value *Cur = builder.CreateLoad(Tier->output_cur);
+    Value *End = builder.CreateLoad(Tier->output_end);
+    Value *Room = builder.CreateSub(builder.CreatePtrToInt(End, int_type),
+                                    builder.CreatePtrToInt(Cur, int_type));
+    Value *Full =
+      builder.CreateICmpULT(Room, ConstantInt::get(int_type, OutputReserved));
+    
+    BasicBlock *Parent = builder.GetInsertBlock();
+    BasicBlock *Flush =
+      BasicBlock::Create(Context, "flush_"+utostr(node->pc), Func);
+    BasicBlock *Put = BasicBlock::Create(Context, "", Func);
+    builder.CreateCondBr(Full, Flush, Put);
+    
+    builder.SetInsertPoint(Flush);
+    CallInst *Flushed = builder.CreateCall(Tier->flush_func, DataArg);
+    builder.CreateBr(Put);
+    
+    builder.SetInsertPoint(Put);
+    PHINode *PHI = builder.CreatePHI(Cur->getType());
+    PHI->addIncoming(Cur, Parent);
+    PHI->addIncoming(Flushed, Flush);
+    OutputPtr = PHI;
   }
+  
+  builder.CreateStore(load_cell(Offset, builder), OutputPtr);
+  OutputPtr = builder.CreateConstInBoundsGEP1_32(OutputPtr, 1);
+  if (--OutputReserved == 0)
+    builder.CreateStore(OutputPtr, Tier->output_cur);
+  
+  compile_link(node->left, builder);
 }
 
-/// compile_get - Emit code for ','
+/// compile_get - Emit code for ',', which takes the next byte of read-ahead
+/// input inline, and calls out to refill the input buffer when it is empty.
 void BrainFTraceRecorder::compile_get(BrainFTraceNode *node,
                                       IRBuilder<>& builder) {
-  Value *Ret = builder.CreateCall(getchar_func);
-  Value *Trunc =
-    builder.CreateTrunc(Ret, IntegerType::get(Ret->getContext(), 8));
-  builder.CreateStore(Ret, Trunc);
-  if (node->left != (BrainFTraceNode*)~0ULL)
-    compile_opcode(node->left, builder);
-  else {
-    HeaderPHI->addIncoming(DataPtr, builder.GetInsertBlock());
-    builder.CreateBr(Header);
-  }
+  LLVMContext &Context = Header->getContext();
+  Function *Func = Header->getParent();
+  Value *Cur = builder.CreateLoad(Tier->input_cur);
+  Value *End = builder.CreateLoad(Tier->input_end);
+  
+  BasicBlock *Buffered =
+    BasicBlock::Create(Context, "buffered_"+utostr(node->pc), Func);
+  BasicBlock *Refill =
+    BasicBlock::Create(Context, "refill_"+utostr(node->pc), Func);
+  BasicBlock *Got = BasicBlock::Create(Context, "", Func);
+  builder.CreateCondBr(builder.CreateICmpEQ(Cur, End), Refill, Buffered);
+  
+  builder.SetInsertPoint(Buffered);
+  Value *Byte = builder.CreateLoad(Cur);
+  builder.CreateStore(builder.CreateConstInBoundsGEP1_32(Cur, 1),
+                      Tier->input_cur);
+  builder.CreateBr(Got);
+  
+  builder.SetInsertPoint(Refill);
+  CallInst *Refilled = builder.CreateCall(Tier->refill_func, DataArg);
+  builder.CreateBr(Got);
+  
+  builder.SetInsertPoint(Got);
+  PHINode *PHI = builder.CreatePHI(Byte->getType());
+  PHI->addIncoming(Byte, Buffered);
+  PHI->addIncoming(Refilled, Refill);
+  BrainFCell &Cell = Cells[Offset];
+  Cell.value = PHI;
+  Cell.delta = 0;
+  Cell.dirty = true;
+  Cell.nonzero = false;
+  
+  compile_link(node->left, builder);
 }
 
-/// compile_if - Emit code for '['
+/// compile_if - Emit code for '['.  A test of a cell whose value is known
+/// along this path is resolved here, and only the edge taken is compiled.
 void BrainFTraceRecorder::compile_if(BrainFTraceNode *node,
                                      IRBuilder<>& builder) {
-  BasicBlock *ZeroChild = 0;
-  BasicBlock *NonZeroChild = 0;
-  BasicBlock *Parent = builder.GetInsertBlock();
-  
   LLVMContext &Context = Header->getContext();
   
   // If both directions of the branch go back to the trace-head, just
   // jump there directly.
-  if (node->left == (BrainFTraceNode*)~0ULL &&
-      node->right == (BrainFTraceNode*)~0ULL) {
-    HeaderPHI->addIncoming(DataPtr, builder.GetInsertBlock());
-    builder.CreateBr(Header);
+  if (node->left == TRACE_HEAD &&
+      node->right == TRACE_HEAD) {
+    compile_link(TRACE_HEAD, builder);
+    return;
+  }
+  
+  Value *Loaded = load_cell(Offset, builder);
+  if (ConstantInt *Known = dyn_cast<ConstantInt>(Loaded)) {
+    if (Known->isZero())
+      compile_edge(node, node->right, VM->code[node->pc].target+1, builder);
+    else
+      compile_edge(node, node->left, node->pc+1, builder);
+    return;
+  }
+  if (Cells[Offset].nonzero) {
+    compile_edge(node, node->left, node->pc+1, builder);
     return;
   }
   
-  // Otherwise, there are two cases to handle for each direction:
-  //   ~0ULL - A branch back to the trace head
-  //   0 - A branch out of the trace
+  // Otherwise, there are three cases to handle for each direction:
+  //   TRACE_HEAD - A branch back to the trace head
+  //   UNTRACED - A branch out of the trace
   //   * - A branch to a node we haven't compiled yet.
-  // Go ahead and generate code for both targets.
-  
-  if (node->left == (BrainFTraceNode*)~0ULL) {
-    NonZeroChild = Header;
-    HeaderPHI->addIncoming(DataPtr, Parent);
-  } else if (node->left == 0) {
-    NonZeroChild = BasicBlock::Create(Context,
-                                   "exit_left_"+utostr(node->pc),
-                                   Header->getParent());
-    builder.SetInsertPoint(NonZeroChild);
+  // Go ahead and generate code for both targets, each knowing which way
+  // the test went.
+  BasicBlock *Parent = builder.GetInsertBlock();
+  Value *ParentPtr = DataPtr;
+  int32_t ParentOffset = Offset;
+  std::map<int32_t, BrainFCell> ParentCells = Cells;
+  
+  BasicBlock *NonZeroChild =
+    BasicBlock::Create(Context,
+                       (node->left == UNTRACED ? "exit_left_" : "left_") +
+                         utostr(node->pc),
+                       Header->getParent());
+  builder.SetInsertPoint(NonZeroChild);
+  Cells[Offset].nonzero = true;
+  compile_child(node, node->left, node->pc+1, builder);
+  
+  BasicBlock *ZeroChild =
+    BasicBlock::Create(Context,
+                       (node->right == UNTRACED ? "exit_right_" : "right_") +
+                         utostr(node->pc),
+                       Header->getParent());
+  
+  // Generate the test and branch to select between the targets, before the
+  // zero edge, which is compiled last as the rest of this path.
+  builder.SetInsertPoint(Parent);
+  Value *Cmp = builder.CreateICmpEQ(Loaded, 
+                                       ConstantInt::get(Loaded->getType(), 0));
+  builder.CreateCondBr(Cmp, ZeroChild, NonZeroChild);
+  
+  builder.SetInsertPoint(ZeroChild);
+  DataPtr = ParentPtr;
+  Offset = ParentOffset;
+  Cells = ParentCells;
+  Cells[Offset].value = ConstantInt::get(Loaded->getType(), 0);
+  compile_edge(node, node->right, VM->code[node->pc].target+1, builder);
+}
+
+/// compile_exit - Emit code for the untraced edge from the '[' node to
+/// exit_pc.  If exit_pc is the head of a compiled trace, the exit calls it
+/// directly, and carries on looping if it comes back to this trace's head.
+/// Otherwise it records where it left the tree for the recorder, and hands
+/// the data pointer and exit_pc back to the interpreter loop.  Either way,
+/// the tape is brought up to date first.
+void BrainFTraceRecorder::compile_exit(BrainFTraceNode *node, size_t exit_pc,
+                                       IRBuilder<>& builder) {
+  LLVMContext &Context = Header->getContext();
+  size_t head_pc = Nodes[0].pc;
+  
+  // An edge back to the trace head that has not been traced yet needs no
+  // more than a branch.
+  if (exit_pc == head_pc) {
+    compile_link(TRACE_HEAD, builder);
+    return;
+  }
+  
+  flush_cells(builder);
+  builder.CreateStore(data_ptr(builder), DataArg);
+  
+  // Trace code is only freed once no trace calls it, and a trace only ever
+  // calls traces that were installed before it was compiled, so calls
+  // between traces cannot recurse.
+  if (VM->code[exit_pc].opcode == OP_TRACE) {
+    Callees.push_back((void*)(intptr_t)VM->traces[exit_pc]);
+    Value *Target = builder.CreateIntToPtr(
+      ConstantInt::get(int_type, (intptr_t)VM->traces[exit_pc]),
+      PointerType::getUnqual(op_type));
+    CallInst *Next =
+      builder.CreateCall2(Target, ConstantInt::get(int_type, exit_pc), DataArg);
+    
+    BasicBlock *Loop = BasicBlock::Create(Context,
+                                          "reenter_"+utostr(node->pc),
+                                          Header->getParent());
+    BasicBlock *Leave = BasicBlock::Create(Context,
+                                           "leave_"+utostr(node->pc),
+                                           Header->getParent());
+    builder.CreateCondBr(
+      builder.CreateICmpEQ(Next, ConstantInt::get(int_type, head_pc)),
+      Loop, Leave);
     
-    // Set the extension leaf, which is a pointer to the leaf of the trace
-    // tree from which we are side exiting.
-    ConstantInt *ExtLeaf = ConstantInt::get(int_type, (intptr_t)node);
-    builder.CreateStore(ExtLeaf, ext_leaf);
+    builder.SetInsertPoint(Loop);
+    HeaderPHI->addIncoming(builder.CreateLoad(DataArg), Loop);
+    builder.CreateBr(Header);
     
-    ConstantInt *NewPc = ConstantInt::get(int_type, node->pc+1);
-    Value *BytecodeIndex =
-      builder.CreateConstInBoundsGEP1_32(bytecode_array, node->pc+1);
-    Value *Target = builder.CreateLoad(BytecodeIndex);
-    CallInst *Call =cast<CallInst>(builder.CreateCall2(Target, NewPc, DataPtr));
-    Call->setTailCall();
-    builder.CreateRetVoid();
-  } else {
-    NonZeroChild = BasicBlock::Create(Context, 
-                                      utostr(node->left->pc), 
-                                      Header->getParent());
-    builder.SetInsertPoint(NonZeroChild);
-    compile_opcode(node->left, builder);
+    // The linked trace has already told the recorder where it left.
+    builder.SetInsertPoint(Leave);
+    builder.CreateRet(Next);
+    return;
   }
   
-  if (node->right == (BrainFTraceNode*)~0ULL) {
-    ZeroChild = Header;
-    HeaderPHI->addIncoming(DataPtr, Parent);
-  } else if (node->right == 0) {
-    ZeroChild = BasicBlock::Create(Context,
-                                   "exit_right_"+utostr(node->pc),
-                                   Header->getParent());
-    builder.SetInsertPoint(ZeroChild);
+  // Once a path from this exit has been traced, it is compiled as a branch
+  // of the tree and installed in the exit's slot.  Jump to it if it is
+  // there, and carry on looping if it comes back to the head.
+  if (Slots && node->opcode == '[') {
+    Value *SlotPtr = builder.CreateIntToPtr(
+      ConstantInt::get(int_type, (intptr_t)&(*Slots)[node - Nodes]),
+      PointerType::getUnqual(int_type));
+    Value *Slot = builder.CreateLoad(SlotPtr, true);
+    
+    BasicBlock *Branch = BasicBlock::Create(Context,
+                                            "branch_"+utostr(node->pc),
+                                            Header->getParent());
+    BasicBlock *Exit = BasicBlock::Create(Context,
+                                          "exit_"+utostr(node->pc),
+                                          Header->getParent());
+    builder.CreateCondBr(
+      builder.CreateICmpEQ(Slot, ConstantInt::get(int_type, 0)),
+      Exit, Branch);
     
-    // Set the extension leaf, which is a pointer to the leaf of the trace
-    // tree from which we are side exiting.
-    ConstantInt *ExtLeaf = ConstantInt::get(int_type, (intptr_t)node);
-    builder.CreateStore(ExtLeaf, ext_leaf);
+    builder.SetInsertPoint(Branch);
+    Value *Target =
+      builder.CreateIntToPtr(Slot, PointerType::getUnqual(op_type));
+    CallInst *Next =
+      builder.CreateCall2(Target, ConstantInt::get(int_type, exit_pc), DataArg);
+    BasicBlock *Loop = BasicBlock::Create(Context,
+                                          "reenter_"+utostr(node->pc),
+                                          Header->getParent());
+    BasicBlock *Leave = BasicBlock::Create(Context,
+                                           "leave_"+utostr(node->pc),
+                                           Header->getParent());
+    builder.CreateCondBr(
+      builder.CreateICmpEQ(Next, ConstantInt::get(int_type, head_pc)),
+      Loop, Leave);
+    
+    builder.SetInsertPoint(Loop);
+    HeaderPHI->addIncoming(builder.CreateLoad(DataArg), Loop);
+    builder.CreateBr(Header);
     
-    ConstantInt *NewPc = ConstantInt::get(int_type, JumpMap[node->pc]+1);
-    Value *BytecodeIndex =
-      builder.CreateConstInBoundsGEP1_32(bytecode_array, JumpMap[node->pc]+1);
-    Value *Target = builder.CreateLoad(BytecodeIndex);
-    CallInst *Call =cast<CallInst>(builder.CreateCall2(Target, NewPc, DataPtr));
-    Call->setTailCall();
-    builder.CreateRetVoid();
-  } else {
-    ZeroChild = BasicBlock::Create(Context, 
-                                      utostr(node->right->pc), 
-                                      Header->getParent());
-    builder.SetInsertPoint(ZeroChild);
-    compile_opcode(node->right, builder);
+    builder.SetInsertPoint(Leave);
+    builder.CreateRet(Next);
+    
+    builder.SetInsertPoint(Exit);
   }
   
-  // Generate the test and branch to select between the targets.
+  // Set the extension root and leaf, the live tree and the index of the
+  // node from which we are side exiting.
+  builder.CreateStore(ExtRoot, Tier->ext_root);
+  builder.CreateStore(ConstantInt::get(int_type, node - Nodes),
+                      Tier->ext_leaf);
+  builder.CreateRet(ConstantInt::get(int_type, exit_pc));
+  UnlinkedExits.push_back(exit_pc);
+}
+
+/// trace_callee - Returns the code to call for the loop at pc: the function
+/// compiled for it if the whole program is being compiled ahead of time,
+/// otherwise its installed trace, or null if it has none.
+Value *BrainFTraceRecorder::trace_callee(size_t pc, IRBuilder<>& builder) {
+  DenseMap<size_t, Function*>::iterator I = AOTLoops.find(pc);
+  if (I != AOTLoops.end())
+    return I->second;
+  if (VM->code[pc].opcode != OP_TRACE)
+    return 0;
+  Callees.push_back((void*)(intptr_t)VM->traces[pc]);
+  return builder.CreateIntToPtr(
+    ConstantInt::get(int_type, (intptr_t)VM->traces[pc]),
+    PointerType::getUnqual(op_type));
+}
+
+/// compile_call - Generate a call to the compiled trace of an inner loop.
+/// The call returns the pc at which the inner trace left, and execution
+/// continues along whichever of the two exits of its loop was taken.  Any
+/// other pc is a side exit from the inner trace, which has already told the
+/// recorder where it left, so it is simply returned.  The inner trace works
+/// on the tape, so it is brought up to date before the call and nothing is
+/// known about it afterwards.
+void BrainFTraceRecorder::compile_call(BrainFTraceNode *node,
+                                       IRBuilder<>& builder) {
+  // A tree loaded from the cache may be compiled before the traces it calls.
+  // Leave at the call until the callee is installed and this tree relinked.
+  Value *Target = trace_callee(node->pc, builder);
+  if (!Target) {
+    compile_exit(node, node->pc, builder);
+    return;
+  }
+  
+  LLVMContext &Context = Header->getContext();
+  
+  flush_cells(builder);
+  builder.CreateStore(data_ptr(builder), DataArg);
+  CallInst *Next =
+    builder.CreateCall2(Target, ConstantInt::get(int_type, node->pc), DataArg);
+  Value *NewPtr = builder.CreateLoad(DataArg);
+  BasicBlock *Parent = builder.GetInsertBlock();
+  
+  BasicBlock *Leave = BasicBlock::Create(Context,
+                                         "leave_"+utostr(node->pc),
+                                         Header->getParent());
+  builder.SetInsertPoint(Leave);
+  builder.CreateRet(Next);
+  
   builder.SetInsertPoint(Parent);
-  Value *Loaded = builder.CreateLoad(DataPtr);
-  Value *Cmp = builder.CreateICmpEQ(Loaded, 
-                                       ConstantInt::get(Loaded->getType(), 0));
-  builder.CreateCondBr(Cmp, ZeroChild, NonZeroChild);
+  SwitchInst *Switch = builder.CreateSwitch(Next, Leave, 2);
+  
+  // Generate code for both exits of the inner loop, as compile_if does.  The
+  // inner loop only leaves through its '[' once the cell it tests is zero.
+  const size_t Exits[2] = { node->pc+1, VM->code[node->pc].target+1 };
+  const uint32_t Links[2] = { node->left, node->right };
+  for (unsigned i = 0; i != 2; ++i) {
+    BasicBlock *Child =
+      BasicBlock::Create(Context,
+                         (Links[i] == UNTRACED ? "exit_" : "") +
+                           utostr(Exits[i]),
+                         Header->getParent());
+    builder.SetInsertPoint(Child);
+    reset_cells(NewPtr);
+    if (Links[i] != UNTRACED && Links[i] != TRACE_HEAD)
+      compile_range_check(Links[i], Exits[i], builder);
+    if (i == 1)
+      Cells[0].value = ConstantInt::get(IntegerType::getInt8Ty(Context), 0);
+    Switch->addCase(ConstantInt::get(int_type, Exits[i]), Child);
+    
+    // The second exit is compiled last, as the rest of this path.
+    if (i == 0)
+      compile_child(node, Links[i], Exits[i], builder);
+    else
+      compile_edge(node, Links[i], Exits[i], builder);
+  }
 }
 
 /// compile_back - Emit code for ']'
 void BrainFTraceRecorder::compile_back(BrainFTraceNode *node,
                                        IRBuilder<>& builder) {
-  if (node->right != (BrainFTraceNode*)~0ULL)
-    compile_opcode(node->right, builder);
-  else {
-    HeaderPHI->addIncoming(DataPtr, builder.GetInsertBlock());
-    builder.CreateBr(Header);
-  }
+  compile_link(node->right, builder);
 }
 
-/// compile_set_zero - Emit Code for '0'
+/// compile_set_zero - Emit Code for '0'.  This overwrites whatever was
+/// pending for the cell, so earlier adds to it are never written.
 void BrainFTraceRecorder::compile_set_zero(BrainFTraceNode *node,
                                            IRBuilder<>& builder) {
-  Constant *Zero =
+  BrainFCell &Cell = Cells[Offset];
+  Cell.value =
     ConstantInt::get(IntegerType::getInt8Ty(Header->getContext()), 0);
-  builder.CreateStore(Zero, DataPtr);
-  if (node->left != (BrainFTraceNode*)~0ULL)
-    compile_opcode(node->left, builder);
-  else {
-    HeaderPHI->addIncoming(DataPtr, builder.GetInsertBlock());
-    builder.CreateBr(Header);
-  }
+  Cell.delta = 0;
+  Cell.dirty = true;
+  Cell.nonzero = false;
+  compile_link(node->left, builder);
+}
+
+/// compile_end - Emit code for 'E', which only ends the trees built for
+/// ahead-of-time compilation, at the end of the program.  It writes back
+/// the tape and data pointer and returns the pc of the end.
+void BrainFTraceRecorder::compile_end(BrainFTraceNode *node,
+                                      IRBuilder<>& builder) {
+  flush_cells(builder);
+  builder.CreateStore(data_ptr(builder), DataArg);
+  builder.CreateRet(ConstantInt::get(int_type, node->pc));
 }
 
 /// compile_opcode - Dispatch to a more specific compiler function based
@@ -365,16 +1196,16 @@ void BrainFTraceRecorder::compile_opcode(BrainFTraceNode *node,
                                          IRBuilder<>& builder) {
   switch (node->opcode) {
     case '+':
-      compile_plus(node, builder);
+      compile_add(node, builder);
       break;
-    case '-':
-      compile_minus(node, builder);
+    case '>':
+      compile_move(node, builder);
       break;
-    case '<':
-      compile_left(node, builder);
+    case '*':
+      compile_mul(node, builder);
       break;
-    case '>':
-      compile_right(node, builder);
+    case 's':
+      compile_scan(node, builder);
       break;
     case '.':
       compile_put(node, builder);
@@ -391,6 +1222,12 @@ void BrainFTraceRecorder::compile_opcode(BrainFTraceNode *node,
     case '0':
       compile_set_zero(node, builder);
       break;
+    case 'T':
+      compile_call(node, builder);
+      break;
+    case 'E':
+      compile_end(node, builder);
+      break;
     default:
       assert(0 && "Unknown opcode?");
   }
@@ -12,7 +12,12 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/System/TimeValue.h"
 #include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 using namespace llvm;
 
 //Command line options
@@ -20,8 +25,94 @@ using namespace llvm;
 static cl::opt<std::string>
 InputFilename(cl::Positional, cl::desc("<input brainf>"));
 
+static cl::opt<bool>
+PrintStats("stats", cl::desc("Print statistics about the trace compiler at "
+                             "exit"));
+
+static cl::opt<bool>
+PrintStatsJSON("stats-json", cl::desc("Print the statistics of -stats as a "
+                                      "JSON object"));
+
+static cl::opt<bool>
+NoJIT("no-jit", cl::desc("Interpret the program without compiling traces"));
+
+static cl::opt<bool>
+CountOpsOpt("count-ops", cl::desc("Count the instructions executed, for "
+                                  "-stats.  Implies -no-jit"));
+
+static cl::opt<std::string>
+AOTOutput("aot", cl::desc("Compile the whole program ahead of time to an "
+                          "executable, or to bitcode, assembly or an object "
+                          "file if the name ends in .bc, .s or .o, instead "
+                          "of running it"),
+          cl::value_desc("filename"));
+
+static cl::opt<std::string>
+CacheDir("cache-dir", cl::desc("Directory in which to keep trace trees "
+                               "between runs"),
+         cl::value_desc("directory"));
+
+static cl::opt<unsigned>
+TapeOffset("tape-offset", cl::desc("Number of cells to the left of the "
+                                   "starting cell"),
+           cl::init(0));
+
+static cl::opt<bool>
+HugePages("huge-pages", cl::desc("Back the tape with transparent huge pages"));
+
+static cl::opt<bool>
+Safe("safe", cl::desc("Check that the program stays on its tape, so that "
+                      "an untrusted one cannot reach other memory"));
+
+static cl::opt<bool>
+Perf("perf", cl::desc("Describe the compiled traces to perf, in "
+                      "/tmp/perf-<pid>.map and a jitdump file"));
+
+static cl::opt<bool>
+Profile("profile", cl::desc("Sample where the program spends its time, and "
+                            "print its hottest loops at exit"));
+
+/// map_program - Map the program in the regular file at path into memory,
+/// so that it is paged in as the loader reads it rather than copied in up
+/// front.  Returns null if the file cannot be mapped.
+static const uint8_t *map_program(const std::string &path, size_t &size) {
+  int FD = open(path.c_str(), O_RDONLY);
+  if (FD < 0)
+    return 0;
+  struct stat Stat;
+  void *Map = MAP_FAILED;
+  if (!fstat(FD, &Stat) && S_ISREG(Stat.st_mode) && Stat.st_size) {
+    size = Stat.st_size;
+    Map = mmap(0, size, PROT_READ, MAP_PRIVATE, FD, 0);
+  }
+  close(FD);
+  if (Map == MAP_FAILED)
+    return 0;
+  madvise(Map, size, MADV_SEQUENTIAL);
+  return (const uint8_t*)Map;
+}
+
+/// hash_program - Compute the key under which the trace trees of the
+/// program loaded into VM are cached, a 64-bit FNV-1a hash of its opcodes
+/// and operands.  The profile counts share their bytes with the offsets,
+/// so a bracket only contributes its opcode and target.
+static uint64_t hash_program(BrainFVM *VM) {
+  uint64_t Hash = 14695981039346656037ULL;
+  for (size_t pc = 0; pc != VM->code_size; ++pc) {
+    const BrainFInsn &Insn = VM->code[pc];
+    bool Bracket = Insn.opcode == OP_IF || Insn.opcode == OP_BACK;
+    uint32_t Words[3] = { Insn.opcode, Bracket ? 0 : (uint32_t)Insn.offset,
+                          (uint32_t)Insn.value };
+    const uint8_t *Bytes = (const uint8_t*)Words;
+    for (size_t i = 0; i != sizeof(Words); ++i)
+      Hash = (Hash ^ Bytes[i]) * 1099511628211ULL;
+  }
+  return Hash;
+}
+
 int main(int argc, char **argv) {
   cl::ParseCommandLineOptions(argc, argv, " BrainF compiler\n");
+  Stats.start_usec = sys::TimeValue::now().usec();
 
   if (InputFilename == "") {
     errs() << "Error: You must specify the filename of the program to "
@@ -29,95 +120,94 @@ int main(int argc, char **argv) {
     abort();
   }
 
-  // Read the input file.
-  MemoryBuffer *Code = MemoryBuffer::getFileOrSTDIN(InputFilename);
-  const uint8_t *CodeBegin = (const uint8_t*)(Code->getBufferStart());
-  
-  // Create a new buffer to hold the preprocessed code.
-  MemoryBuffer *ParsedCode =
-    MemoryBuffer::getNewMemBuffer(sizeof(opcode_func_t) * 
-                                  (Code->getBufferSize()+1));
-  BytecodeArray = (opcode_func_t*)(ParsedCode->getBufferStart());
-  size_t BytecodeOffset = 0;
-  
-  // Create JumpMap, a special on-the-side data array used to implement
-  // efficient jumps in the interpreter.
-  JumpMap = new size_t[Code->getBufferSize()];
-  memset(JumpMap, 0, sizeof(size_t) * Code->getBufferSize());
-  std::vector<size_t> Stack;
-  
-  // Preprocess the input source code, performing three tasks:
-  //  1 - Remove non-instruction characters
-  //  2 - Replace character literals with opcode function pointers
-  //  3 - Precompute the jump targets for [ and ] instructions in JumpMap
-  for (size_t i = 0; i < Code->getBufferSize(); ++i) {
-    uint8_t opcode = CodeBegin[i];
-    switch (opcode) {
-      case '>':
-        BytecodeArray[BytecodeOffset++] = &op_right;
-        break;
-      case '<':
-        BytecodeArray[BytecodeOffset++] = &op_left;
-        break;
-      case '+':
-        BytecodeArray[BytecodeOffset++] = &op_plus;
-        break;
-      case '-':
-        BytecodeArray[BytecodeOffset++] = &op_minus;
-        break;
-      case '.':
-        BytecodeArray[BytecodeOffset++] = &op_put;
-        break;
-      case ',':
-        BytecodeArray[BytecodeOffset++] = &op_get;
-        break;
-      case '[':
-        Stack.push_back(BytecodeOffset);
-        BytecodeArray[BytecodeOffset++] = &op_if;
-        break;
-      case ']':
-        // Special case: [-] --> 0
-        if (CodeBegin[i-1] == '-' && CodeBegin[i-2] == '[') {
-          Stack.pop_back();
-          BytecodeOffset -= 2;
-          BytecodeArray[BytecodeOffset++] = &op_set_zero;
-        } else {
-          JumpMap[Stack.back()] = BytecodeOffset;
-          JumpMap[BytecodeOffset] = Stack.back();
-          Stack.pop_back();
-          BytecodeArray[BytecodeOffset++] = &op_back;
-        }
-        break;
-      default:
-        continue;
+  // Map the input file, or read it if it cannot be mapped, and load it into
+  // a VM.  Unless the whole program is needed up front, the VM preprocesses
+  // the program as it runs it, which it may start doing long before the
+  // end of a large file.
+  size_t CodeSize;
+  MemoryBuffer *Code = 0;
+  const uint8_t *CodeBegin = map_program(InputFilename, CodeSize);
+  if (!CodeBegin) {
+    Code = MemoryBuffer::getFileOrSTDIN(InputFilename);
+    if (!Code) {
+      errs() << "Error: could not read " << InputFilename << ".\n";
+      return 1;
     }
+    CodeBegin = (const uint8_t*)Code->getBufferStart();
+    CodeSize = Code->getBufferSize();
+  }
+  bool JIT = !NoJIT && !CountOpsOpt;
+  bool Lazy = AOTOutput.empty() && !(JIT && !CacheDir.empty());
+  std::string Error;
+  BrainFVM *VM = brainf_vm_create(CodeBegin, CodeSize, Error, Lazy,
+                                  Perf || Profile);
+  if (!VM) {
+    errs() << "Error: " << Error << ".\n";
+    return 1;
   }
   
-  // Fill in the suffix of the preprocessed source for op_exit.
-  // Thus, if we reach the end of the source, the program will terminate.
-  while (BytecodeOffset < Code->getBufferSize()+1) {
-    BytecodeArray[BytecodeOffset++] = &op_end;
+  // With -aot, compile the program instead of running it.
+  if (!AOTOutput.empty()) {
+    if (Safe) {
+      errs() << "Error: -safe is not supported with -aot.\n";
+      brainf_vm_destroy(VM);
+      return 1;
+    }
+    BrainFTraceRecorder Compiler(VM, false);
+    bool Compiled = Compiler.compile_program(AOTOutput, TapeOffset);
+    brainf_vm_destroy(VM);
+    return Compiled ? 0 : 1;
   }
   
-  // Setup the array.
-  uint8_t *BrainFArray = new uint8_t[32768];
-  memset(BrainFArray, 0, 32768);
+  // Setup the trace recorder, and have it compile the trees cached by any
+  // earlier run of this program.
+  VM->count_ops = CountOpsOpt;
+  VM->profile = Profile;
+  VM->safe = Safe;
+  VM->recorder = new BrainFTraceRecorder(VM, JIT);
+  if (Perf || Profile)
+    brainf_profile_open(VM, InputFilename, Perf, Profile);
+  uint64_t CacheKey = 0;
+  std::string CachePath;
+  if (JIT && !CacheDir.empty()) {
+    CacheKey = hash_program(VM);
+    char Name[32];
+    snprintf(Name, sizeof(Name), "/%016llx.bftc", (unsigned long long)CacheKey);
+    CachePath = CacheDir;
+    CachePath += Name;
+    VM->recorder->load_cache(CachePath, CacheKey);
+  }
   
-  // Setup the trace recorder.
-  Recorder = new BrainFTraceRecorder();
+  // Run the program on a tape that grows on demand, so that it can use as
+  // much of the tape as it likes.
+  bool Sampling = PrintStats || PrintStatsJSON || Profile;
+  if (Sampling)
+    brainf_sampler_start();
+  bool Completed = brainf_vm_run(VM, TapeOffset, HugePages);
+  if (Sampling)
+    brainf_sampler_stop();
+  brainf_profile_close(errs());
+  if (!Completed) {
+    errs() << "Error: the program moved off the end of the tape.  Use "
+              "-tape-offset to reserve cells to the left of the starting "
+              "cell.\n";
+    brainf_vm_destroy(VM);
+    return 1;
+  }
   
-  // Main interpreter loop.
-  // Note the lack of a explicit loop: every opcode is a tail-recursive
-  // function that calls its own successor by indexing into BytecodeArray.
-  uint8_t* data = BrainFArray;  
-  BytecodeArray[0](0, data);
+  if (!CachePath.empty())
+    VM->recorder->save_cache(CachePath, CacheKey);
   
   //Clean up
-  delete Recorder;
-  delete Code;
-  delete ParsedCode;
-  delete[] BrainFArray;
-  delete[] JumpMap;
+  brainf_vm_destroy(VM);
+  if (Code)
+    delete Code;
+  else
+    munmap((void*)CodeBegin, CodeSize);
+  
+  // The compiler thread has stopped, so its counters are final.
+  if (PrintStats || PrintStatsJSON)
+    brainf_print_stats(errs(), PrintStatsJSON);
 
   return 0;
 }
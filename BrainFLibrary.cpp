@@ -0,0 +1,106 @@
+//===-- BrainFLibrary.cpp - Running BrainF programs from C++ -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------===//
+
+#include "BrainFLibrary.h"
+#include "BrainFVM.h"
+#include <unistd.h>
+
+bool brainf_run(BrainFJob &job) {
+  job.output.clear();
+  job.error.clear();
+  BrainFVM *VM = brainf_vm_create((const uint8_t*)job.program,
+                                  job.program_size, job.error, true);
+  if (!VM)
+    return false;
+  
+  // Read from the caller's buffer in place, and gather the output in the
+  // job rather than writing it anywhere.
+  VM->output_fd = -1;
+  VM->output = &job.output;
+  VM->input_fd = -1;
+  VM->input_cur = (uint8_t*)job.input;
+  VM->input_end = VM->input_cur + job.input_size;
+  VM->safe = job.safe;
+  VM->recorder = new BrainFTraceRecorder(VM, job.jit);
+  
+  bool Completed = brainf_vm_run(VM, job.tape_offset, false);
+  if (!Completed)
+    job.error = "the program moved off the end of the tape";
+  brainf_vm_destroy(VM);
+  return Completed;
+}
+
+BrainFPool::BrainFPool(unsigned threads) : pending(0), shutting_down(false) {
+  if (!threads) {
+    long Online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = Online > 0 ? Online : 1;
+  }
+  pthread_mutex_init(&lock, 0);
+  pthread_cond_init(&work_cond, 0);
+  pthread_cond_init(&done_cond, 0);
+  
+  workers.resize(threads);
+  for (unsigned i = 0; i != threads; ++i)
+    pthread_create(&workers[i], 0, worker_main, this);
+}
+
+BrainFPool::~BrainFPool() {
+  pthread_mutex_lock(&lock);
+  shutting_down = true;
+  pthread_cond_broadcast(&work_cond);
+  pthread_mutex_unlock(&lock);
+  for (unsigned i = 0, e = workers.size(); i != e; ++i)
+    pthread_join(workers[i], 0);
+  
+  pthread_cond_destroy(&done_cond);
+  pthread_cond_destroy(&work_cond);
+  pthread_mutex_destroy(&lock);
+}
+
+void BrainFPool::submit(BrainFJob *job) {
+  pthread_mutex_lock(&lock);
+  queue.push_back(job);
+  ++pending;
+  pthread_cond_signal(&work_cond);
+  pthread_mutex_unlock(&lock);
+}
+
+void BrainFPool::wait() {
+  pthread_mutex_lock(&lock);
+  while (pending)
+    pthread_cond_wait(&done_cond, &lock);
+  pthread_mutex_unlock(&lock);
+}
+
+void *BrainFPool::worker_main(void *pool) {
+  ((BrainFPool*)pool)->work();
+  return 0;
+}
+
+/// work - Run queued jobs until the pool is destroyed and the queue is
+/// empty.
+void BrainFPool::work() {
+  pthread_mutex_lock(&lock);
+  while (true) {
+    while (queue.empty() && !shutting_down)
+      pthread_cond_wait(&work_cond, &lock);
+    if (queue.empty())
+      break;
+    
+    BrainFJob *Job = queue.front();
+    queue.pop_front();
+    pthread_mutex_unlock(&lock);
+    brainf_run(*Job);
+    pthread_mutex_lock(&lock);
+    
+    if (--pending == 0)
+      pthread_cond_broadcast(&done_cond);
+  }
+  pthread_mutex_unlock(&lock);
+}
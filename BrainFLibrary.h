@@ -0,0 +1,85 @@
+//===-- BrainFLibrary.h - Running BrainF programs from C++ ----*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------===//
+//
+// The interface for embedding the VM: run a program over an input buffer
+// and collect its output, on the calling thread or on a pool of worker
+// threads.  Each run gets a VM of its own, so runs never share state.
+//===--------------------------------------------------------------------===//
+
+#ifndef BRAINF_LIBRARY_H
+#define BRAINF_LIBRARY_H
+
+#include "stdint.h"
+#include <deque>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+/// BrainFJob - One run of a program.  The program and its input are not
+/// copied, and must stay alive until the run has finished.
+struct BrainFJob {
+  const char *program;
+  size_t program_size;
+  const char *input;
+  size_t input_size;
+  
+  // Whether to trace and compile the program's hot loops, and the number of
+  // cells to reserve to the left of the starting cell.
+  bool jit;
+  size_t tape_offset;
+  
+  // Whether to check that the program stays on its tape, as any program
+  // that is not trusted must be.
+  bool safe;
+  
+  // Filled in by the run: everything the program wrote, and why it failed,
+  // if it did.
+  std::string output;
+  std::string error;
+  
+  BrainFJob()
+    : program(0), program_size(0), input(0), input_size(0), jit(true),
+      tape_offset(0), safe(false) { }
+};
+
+/// brainf_run - Run job on this thread.  Returns false, having set
+/// job.error, if the program could not be loaded or moved off the end of
+/// its tape.
+bool brainf_run(BrainFJob &job);
+
+/// BrainFPool - A fixed set of worker threads that run jobs as they are
+/// submitted, each on its own VM.
+class BrainFPool {
+  std::vector<pthread_t> workers;
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond, done_cond;
+  std::deque<BrainFJob*> queue;
+  unsigned pending;
+  bool shutting_down;
+  
+  static void *worker_main(void *pool);
+  void work();
+  
+public:
+  /// BrainFPool - Start threads workers, or one per online processor if it
+  /// is zero.
+  explicit BrainFPool(unsigned threads = 0);
+  
+  /// ~BrainFPool - Finish the jobs already submitted, and stop the workers.
+  ~BrainFPool();
+  
+  /// submit - Queue job to be run by the next free worker.  The job must
+  /// stay alive until wait() returns.
+  void submit(BrainFJob *job);
+  
+  /// wait - Block until every submitted job has finished.
+  void wait();
+};
+
+#endif
@@ -8,68 +8,380 @@
 //===--------------------------------------------------------------------===//
 
 #include "BrainFVM.h"
-#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
 
-opcode_func_t *BytecodeArray = 0;
-size_t *JumpMap = 0;
-uint8_t executed = 0;
-uint8_t mode = 0;
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-BrainFTraceRecorder *Recorder = 0;
+uint8_t *brainf_flush(BrainFVM *vm) {
+  uint8_t *pos = vm->output_buffer;
+  if (vm->output_fd < 0) {
+    vm->output->append((const char*)pos, vm->output_cur - pos);
+    return vm->output_cur = pos;
+  }
+  
+  while (pos != vm->output_cur) {
+    ssize_t written = write(vm->output_fd, pos, vm->output_cur - pos);
+    if (written < 0 && errno == EINTR) continue;
+    if (written < 0) break;
+    pos += written;
+  }
+  return vm->output_cur = vm->output_buffer;
+}
+
+uint8_t brainf_refill(BrainFVM *vm) {
+  // A program prompting for input expects its prompt to be visible first.
+  brainf_flush(vm);
+  if (vm->input_fd < 0)
+    return 255;
+  
+  ssize_t count;
+  do {
+    count = read(vm->input_fd, vm->input_buffer, IO_BUF_SIZE);
+  } while (count < 0 && errno == EINTR);
+  if (count <= 0)
+    return 255;
+  
+  vm->input_cur = vm->input_buffer + 1;
+  vm->input_end = vm->input_buffer + count;
+  return vm->input_buffer[0];
+}
 
-void op_plus(size_t pc, uint8_t *data) {
-  Recorder->record_simple(pc, '+', pc+1);
-  *data += 1;
-  BytecodeArray[pc+1](pc+1, data);
+#if defined(__AVX2__) || defined(__SSE2__)
+#if defined(__AVX2__)
+#define SCAN_WIDTH 32
+#else
+#define SCAN_WIDTH 16
+#endif
+
+/// scan_zero_mask - Returns a bitmask of the zero cells in the SCAN_WIDTH
+/// aligned cells starting at block.
+static inline uint32_t scan_zero_mask(const uint8_t *block) {
+#if defined(__AVX2__)
+  __m256i cells = _mm256_load_si256((const __m256i*)block);
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(cells,
+                                                _mm256_setzero_si256()));
+#else
+  __m128i cells = _mm_load_si128((const __m128i*)block);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(cells, _mm_setzero_si128()));
+#endif
 }
+#endif
 
-void op_minus(size_t pc, uint8_t *data) {
-  Recorder->record_simple(pc, '-', pc+1);
-  *data -= 1;
-  BytecodeArray[pc+1](pc+1, data);
+uint8_t *brainf_scan(uint8_t *data, int32_t stride) {
+  if (!*data) return data;
+  
+#if defined(__AVX2__) || defined(__SSE2__)
+  // Vectorize strides that divide the vector width, so that the cells on the
+  // stride fall in the same lanes of every block.  Loads are aligned, which
+  // keeps them from crossing into a page the scalar loop would not touch.
+  uint32_t step = stride < 0 ? -stride : stride;
+  if (step <= SCAN_WIDTH && SCAN_WIDTH % step == 0) {
+    const uint32_t all = SCAN_WIDTH == 32 ? ~0U : (1U << SCAN_WIDTH) - 1;
+    uint32_t start = (uintptr_t)data % SCAN_WIDTH;
+    const uint8_t *block = data - start;
+    
+    uint32_t lanes = 0;
+    for (uint32_t i = start % step; i < SCAN_WIDTH; i += step)
+      lanes |= 1U << i;
+    
+    if (stride > 0) {
+      uint32_t mask = lanes & (all << start);
+      for (;;) {
+        uint32_t hits = scan_zero_mask(block) & mask;
+        if (hits) return (uint8_t*)block + __builtin_ctz(hits);
+        block += SCAN_WIDTH;
+        mask = lanes;
+      }
+    } else {
+      uint32_t mask = lanes & (all >> (SCAN_WIDTH - 1 - start));
+      for (;;) {
+        uint32_t hits = scan_zero_mask(block) & mask;
+        if (hits) return (uint8_t*)block + 31 - __builtin_clz(hits);
+        block -= SCAN_WIDTH;
+        mask = lanes;
+      }
+    }
+  }
+#endif
+  
+  while (*data) data += stride;
+  return data;
 }
 
-void op_left(size_t pc, uint8_t *data) {
-  Recorder->record_simple(pc, '<', pc+1);
-  BytecodeArray[pc+1](pc+1, data-1);
+// The opcode handlers.  Each executes the instruction at pc, updates the data
+// pointer in place and returns the pc of its successor.  They are inlined
+// into the dispatch loop in run(), which keeps the data pointer in a
+// register between instructions.
+//
+// Every handler is specialized on the state of the recorder.  While it is
+// only profiling, no handler but op_if touches it at all; while it is
+// recording, every handler appends itself to the trace buffer.
+
+/// op_add - Implements a run of '+' and '-' instructions, folded into a
+/// single add to the cell at a constant offset from the data pointer.
+template<bool Recording>
+static inline size_t op_add(BrainFVM *vm, const BrainFInsn *code, size_t pc,
+                            uint8_t **data) {
+  if (Recording) vm->recorder->record_simple(pc, '+', pc+1);
+  (*data)[code[pc].offset] += code[pc].value;
+  return pc+1;
 }
 
-void op_right(size_t pc, uint8_t *data) {
-  Recorder->record_simple(pc, '>', pc+1);
-  BytecodeArray[pc+1](pc+1, data+1);
+/// op_move - Implements a run of '<' and '>' instructions, folded into a
+/// single move of the data pointer.  In safe mode, a move off the tape ends
+/// the run.  No other instruction needs checking, as none reaches more than
+/// MAX_OFFSET cells from the data pointer, and every cell a scan steps onto
+/// is read, so the guard pages catch them.
+template<bool Recording, bool Safe>
+static inline size_t op_move(BrainFVM *vm, const BrainFInsn *code, size_t pc,
+                             uint8_t **data) {
+  if (Recording) vm->recorder->record_simple(pc, '>', pc+1);
+  *data += code[pc].value;
+  if (Safe && (*data < vm->tape.begin || *data >= vm->tape.end))
+    siglongjmp(vm->tape_exit, 1);
+  return pc+1;
 }
 
-void op_put(size_t pc, uint8_t *data) {
-  Recorder->record_simple(pc, '.', pc+1);
-  putchar(*data);
-  BytecodeArray[pc+1](pc+1, data);
+/// op_scan - Implements a scan loop such as [>], [<] or [>>>>], which moves
+/// the data pointer by a constant stride until it reaches a zero cell.
+template<bool Recording>
+static inline size_t op_scan(BrainFVM *vm, const BrainFInsn *code, size_t pc,
+                             uint8_t **data) {
+  if (Recording) vm->recorder->record_simple(pc, 's', pc+1);
+  *data = brainf_scan(*data, code[pc].value);
+  return pc+1;
 }
 
-void op_get(size_t pc, uint8_t *data) {
-  Recorder->record_simple(pc, ',', pc+1);
-  *data = getchar();
-  BytecodeArray[pc+1](pc+1, data);
+/// op_mul - Implements one multiply-accumulate of a rewritten balanced loop:
+/// data[offset] += value * data[0].  The target cell is left untouched when
+/// data[0] is zero, as the loop would not have run, since it may lie off the
+/// end of the tape.
+template<bool Recording>
+static inline size_t op_mul(BrainFVM *vm, const BrainFInsn *code, size_t pc,
+                            uint8_t **data) {
+  if (Recording) vm->recorder->record_simple(pc, '*', pc+1);
+  if (uint8_t Counter = (*data)[0])
+    (*data)[code[pc].offset] += code[pc].value * Counter;
+  return pc+1;
 }
 
-void op_if(size_t pc, uint8_t *data) {
+// op_put - Implements the '.' instruction.
+template<bool Recording>
+static inline size_t op_put(BrainFVM *vm, const BrainFInsn *code, size_t pc,
+                            uint8_t **data) {
+  if (Recording) vm->recorder->record_simple(pc, '.', pc+1);
+  brainf_putc(vm, **data);
+  return pc+1;
+}
+
+// op_get - Implements the ',' instruction.
+template<bool Recording>
+static inline size_t op_get(BrainFVM *vm, const BrainFInsn *code, size_t pc,
+                            uint8_t **data) {
+  if (Recording) vm->recorder->record_simple(pc, ',', pc+1);
+  **data = brainf_getc(vm);
+  return pc+1;
+}
+
+// op_if - Implements the '[' instruction.
+template<bool Recording>
+static inline size_t op_if(BrainFVM *vm, const BrainFInsn *code, size_t pc,
+                           uint8_t **data) {
   size_t new_pc = pc+1;
-  if (!*data) new_pc = JumpMap[pc]+1;
-  Recorder->record(pc, '[', new_pc);
-  BytecodeArray[new_pc](new_pc, data);
+  if (!**data) new_pc = code[pc].target+1;
+  if (Recording) vm->recorder->record(pc, '[', new_pc);
+  else vm->recorder->profile(pc);
+  return new_pc;
 }
 
-void op_back(size_t pc, uint8_t *data) {
-  size_t new_pc = JumpMap[pc];
-  Recorder->record_simple(pc, ']', new_pc);
-  BytecodeArray[new_pc](new_pc, data);
+// op_back - Implements the ']' instruction.
+template<bool Recording>
+static inline size_t op_back(BrainFVM *vm, const BrainFInsn *code, size_t pc,
+                             uint8_t **) {
+  size_t new_pc = code[pc].target;
+  if (Recording) vm->recorder->record_simple(pc, ']', new_pc);
+  return new_pc;
 }
 
-void op_set_zero(size_t pc, uint8_t *data) {
-  Recorder->record_simple(pc, '0', pc+1);
-  *data = 0;
-  BytecodeArray[pc+1](pc+1, data);
+// op_set_zero - Implements the '0' synthetic instruction.
+template<bool Recording>
+static inline size_t op_set_zero(BrainFVM *vm, const BrainFInsn *code,
+                                 size_t pc, uint8_t **data) {
+  if (Recording) vm->recorder->record_simple(pc, '0', pc+1);
+  **data = 0;
+  return pc+1;
 }
 
-void op_end(size_t, uint8_t *) {
-  return;
+// op_trace - Enters the compiled trace installed at pc.  The trace runs until
+// it leaves the traced code and returns the pc at which to resume, which the
+// recorder may then extend the trace from.  While recording, the call is
+// recorded instead, so that an outer loop can be traced around it.  The
+// trace works on vm->data, so the caller keeps it up to date.  Once it
+// returns, the interpreter is in no trace, so any code retired before then
+// can be freed.
+//
+// In safe mode, a trace that finds it would move off the tape returns its
+// own pc without having run, and the loop is run here instead, where every
+// move is checked.
+template<bool Recording>
+static inline size_t op_trace(BrainFVM *vm, size_t pc) {
+  if (Recording) vm->recorder->enter_call(pc);
+  ++Stats.trace_entries;
+  Stats.in_trace = 1;
+  size_t new_pc = vm->traces[pc](pc, vm);
+  Stats.in_trace = 0;
+  vm->quiescent_epoch = vm->retire_epoch;
+  if (Recording) vm->recorder->record_call(pc, new_pc);
+  else vm->recorder->exit_trace();
+  if (new_pc == pc)
+    new_pc = *vm->data ? pc+1 : vm->code[pc].target+1;
+  return new_pc;
+}
+
+// The dispatch loop.  With GCC-compatible compilers this is direct threaded:
+// every handler ends in its own indirect jump through the label table, which
+// predicts far better than a single shared dispatch branch.  Elsewhere it
+// falls back to a switch that each handler jumps back to.
+//
+// Each specialization of run() has its own table, and returns to interpret()
+// to switch tables when the recorder changes state.  The recording variant
+// checks for this after every instruction; the profiling variant only after
+// the two instructions that can start a recording, op_if and op_trace.  The
+// instrumented variants, used by -count-ops and -profile whether recording
+// or not, count the instructions they execute and publish the pc of each
+// for the sampling profiler.  The safe variants check the moves of the data
+// pointer.
+#if defined(__GNUC__)
+#define NEXT() do {                                               \
+    if (Instrumented) {                                           \
+      ++ops;                                                      \
+      vm->sample_pc = pc;                                         \
+    }                                                             \
+    goto *Labels[Code[pc].opcode];                                \
+  } while (0)
+#define TARGET(Opcode) L_##Opcode:
+#else
+#define NEXT() do {                                               \
+    if (Instrumented) {                                           \
+      ++ops;                                                      \
+      vm->sample_pc = pc;                                         \
+    }                                                             \
+    goto dispatch;                                                \
+  } while (0)
+#define TARGET(Opcode) case Opcode:
+#endif
+
+#define LEAVE() do {                                              \
+    if (Instrumented) Stats.ops_executed += ops;                  \
+    vm->data = ptr;                                               \
+    return pc;                                                    \
+  } while (0)
+
+#define DISPATCH_CHECKED() do {                                   \
+    if (vm->recorder->is_recording() != Recording) LEAVE();       \
+    NEXT();                                                       \
+  } while (0)
+
+#define DISPATCH() do {                                           \
+    if (Recording) DISPATCH_CHECKED();                            \
+    NEXT();                                                       \
+  } while (0)
+
+template<bool Recording, bool Instrumented, bool Safe>
+static size_t run(BrainFVM *vm, size_t pc) {
+  const BrainFInsn *Code = vm->code;
+  uint8_t *ptr = vm->data;
+  uint64_t ops = 0;
+  
+#if defined(__GNUC__)
+  static void *const Labels[] = {
+    &&L_OP_ADD, &&L_OP_MOVE, &&L_OP_SCAN, &&L_OP_MUL, &&L_OP_PUT, &&L_OP_GET,
+    &&L_OP_IF, &&L_OP_BACK, &&L_OP_SET_ZERO, &&L_OP_TRACE, &&L_OP_END
+  };
+  NEXT();
+#else
+  dispatch: switch (Code[pc].opcode) {
+#endif
+  
+  TARGET(OP_ADD)
+    pc = op_add<Recording>(vm, Code, pc, &ptr);
+    DISPATCH();
+  
+  TARGET(OP_MOVE)
+    pc = op_move<Recording, Safe>(vm, Code, pc, &ptr);
+    DISPATCH();
+  
+  TARGET(OP_SCAN)
+    pc = op_scan<Recording>(vm, Code, pc, &ptr);
+    DISPATCH();
+  
+  TARGET(OP_MUL)
+    pc = op_mul<Recording>(vm, Code, pc, &ptr);
+    DISPATCH();
+  
+  TARGET(OP_PUT)
+    pc = op_put<Recording>(vm, Code, pc, &ptr);
+    DISPATCH();
+  
+  TARGET(OP_GET)
+    pc = op_get<Recording>(vm, Code, pc, &ptr);
+    DISPATCH();
+  
+  TARGET(OP_IF)
+    pc = op_if<Recording>(vm, Code, pc, &ptr);
+    DISPATCH_CHECKED();
+  
+  TARGET(OP_BACK)
+    pc = op_back<Recording>(vm, Code, pc, &ptr);
+    DISPATCH();
+  
+  TARGET(OP_SET_ZERO)
+    pc = op_set_zero<Recording>(vm, Code, pc, &ptr);
+    DISPATCH();
+  
+  // Compiled code works on vm->data, so hand it ptr there rather than
+  // letting ptr escape the loop.
+  TARGET(OP_TRACE)
+    vm->data = ptr;
+    pc = op_trace<Recording>(vm, pc);
+    ptr = vm->data;
+    DISPATCH_CHECKED();
+  
+  TARGET(OP_END)
+    LEAVE();
+  
+#if !defined(__GNUC__)
+  }
+#endif
+}
+
+#undef DISPATCH
+#undef DISPATCH_CHECKED
+#undef LEAVE
+#undef NEXT
+#undef TARGET
+
+size_t interpret(BrainFVM *vm, size_t pc) {
+  while (vm->code[pc].opcode != OP_END) {
+    bool Safe = vm->safe;
+    bool Instrumented = vm->count_ops || vm->profile;
+    if (vm->recorder->is_recording() && Instrumented)
+      pc = Safe ? run<true, true, true>(vm, pc)
+                : run<true, true, false>(vm, pc);
+    else if (vm->recorder->is_recording())
+      pc = Safe ? run<true, false, true>(vm, pc)
+                : run<true, false, false>(vm, pc);
+    else if (Instrumented)
+      pc = Safe ? run<false, true, true>(vm, pc)
+                : run<false, true, false>(vm, pc);
+    else
+      pc = Safe ? run<false, false, true>(vm, pc)
+                : run<false, false, false>(vm, pc);
+  }
+  return pc;
 }
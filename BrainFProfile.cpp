@@ -0,0 +1,386 @@
+//===-- BrainFProfile.cpp - BrainF profiling support ----------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------===//
+//
+// Two ways of finding out where a program spends its time.
+//
+// With -perf, each trace and branch the JIT installs is described to perf,
+// both in /tmp/perf-<pid>.map, which perf report reads as it is, and in a
+// jitdump file, /tmp/jit-<pid>.dump, which perf inject merges into a
+// recording along with a copy of the code.  Each is named after the pc and
+// the source line and column of the loop it was compiled from.  Code that
+// is freed is not described again; perf only looks up the address ranges
+// of the code it finds in its samples.
+//
+// With -profile, the sampler of BrainFStats.cpp also hands each sample of
+// the interpreter thread to brainf_profile_sample, which attributes it to
+// a pc: in compiled code, that of the trace or branch the sample landed in,
+// and otherwise the instruction the interpreter last dispatched.  At exit,
+// the samples are added up by the innermost loop around their pc and the
+// hottest loops reported against the source.
+//===--------------------------------------------------------------------===//
+
+#include "BrainFVM.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/System/Atomic.h"
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <elf.h>
+#include <fcntl.h>
+#include <map>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/// MAX_CODE_RANGES - The most traces and branches the sampler can tell
+/// apart.  Later ones are sampled as their trace head.
+#define MAX_CODE_RANGES 65536
+
+/// SAMPLE_SLOTS - The size of the table of samples per pc, a power of two.
+#define SAMPLE_SLOTS 65536
+
+/// REPORT_LOOPS - The number of loops in the hot-spot report.
+#define REPORT_LOOPS 20
+
+// The jitdump format, as described in tools/perf/Documentation of Linux.
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+#define JIT_CODE_CLOSE 3
+
+#if defined(__x86_64__)
+#define JITDUMP_MACHINE EM_X86_64
+#elif defined(__i386__)
+#define JITDUMP_MACHINE EM_386
+#elif defined(__arm__)
+#define JITDUMP_MACHINE EM_ARM
+#else
+#define JITDUMP_MACHINE EM_NONE
+#endif
+
+namespace {
+  struct JITDumpHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+  };
+  
+  struct JITDumpRecord {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+  };
+  
+  struct JITDumpCodeLoad {
+    JITDumpRecord record;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+  };
+  
+  /// CodeRange - The machine code compiled for the loop at pc.
+  struct CodeRange {
+    uintptr_t begin, end;
+    size_t pc;
+  };
+  
+  /// LoopSamples - The samples taken in a loop, interpreting and in its
+  /// compiled code.
+  struct LoopSamples {
+    size_t pc;
+    uint64_t interpreted, compiled;
+    
+    LoopSamples() : pc(0), interpreted(0), compiled(0) { }
+    
+    uint64_t total() const { return interpreted + compiled; }
+    bool operator<(const LoopSamples &RHS) const {
+      return total() > RHS.total();
+    }
+  };
+}
+
+static BrainFVM *ProfiledVM;
+static std::string ProgramName;
+static bool Sampling;
+
+// Written by the compiler thread under PerfLock.
+static pthread_mutex_t PerfLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *PerfMap, *JITDump;
+static void *JITDumpMarker;
+static uint64_t CodeIndex;
+
+// Appended to by the compiler thread and searched by the sampler, which
+// only looks at the first CodeRangeCount, so each range is published once
+// it is whole.  The code of a range may be freed and reused, but only by
+// code whose range comes later, and the sampler searches newest first.
+static CodeRange CodeRanges[MAX_CODE_RANGES];
+static volatile unsigned CodeRangeCount;
+
+// The samples, keyed by one more than twice their pc, plus one if they
+// were taken in compiled code.  Only the sampler writes to them.
+static volatile size_t SampleKeys[SAMPLE_SLOTS];
+static volatile uint64_t SampleCounts[SAMPLE_SLOTS];
+static volatile uint64_t DroppedSamples;
+
+/// timestamp - The time in the clock perf uses for jitdump records.
+static uint64_t timestamp() {
+  struct timespec Now;
+  clock_gettime(CLOCK_MONOTONIC, &Now);
+  return Now.tv_sec * 1000000000ULL + Now.tv_nsec;
+}
+
+/// open_jitdump - Create the jitdump file and write its header.  Returns
+/// false if it cannot be created.
+static bool open_jitdump() {
+  char Path[64];
+  snprintf(Path, sizeof(Path), "/tmp/jit-%d.dump", (int)getpid());
+  int FD = open(Path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+  if (FD < 0)
+    return false;
+  
+  // perf record finds the file by this mapping of it, which must be
+  // executable for perf to keep it.
+  JITDumpMarker = mmap(0, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC,
+                       MAP_PRIVATE, FD, 0);
+  if (JITDumpMarker == MAP_FAILED) {
+    JITDumpMarker = 0;
+    close(FD);
+    return false;
+  }
+  JITDump = fdopen(FD, "w");
+  
+  JITDumpHeader Header;
+  memset(&Header, 0, sizeof(Header));
+  Header.magic = JITDUMP_MAGIC;
+  Header.version = JITDUMP_VERSION;
+  Header.total_size = sizeof(Header);
+  Header.elf_mach = JITDUMP_MACHINE;
+  Header.pid = getpid();
+  Header.timestamp = timestamp();
+  fwrite(&Header, sizeof(Header), 1, JITDump);
+  fflush(JITDump);
+  return true;
+}
+
+void brainf_profile_open(BrainFVM *vm, const std::string &program,
+                         bool perf, bool sample) {
+  ProfiledVM = vm;
+  ProgramName = program;
+  Sampling = sample;
+  if (!perf)
+    return;
+  
+  char Path[64];
+  snprintf(Path, sizeof(Path), "/tmp/perf-%d.map", (int)getpid());
+  PerfMap = fopen(Path, "w");
+  if (!PerfMap || !open_jitdump())
+    errs() << "Warning: could not create the files for -perf in /tmp.\n";
+}
+
+/// describe - Name the code compiled from the loop at pc of vm after its
+/// place in the source.
+static std::string describe(BrainFVM *vm, size_t pc, const char *kind) {
+  char Name[64];
+  unsigned Line, Column;
+  if (brainf_source_location(vm, pc, Line, Column))
+    snprintf(Name, sizeof(Name), ":%u:%u %s pc %lu", Line, Column, kind,
+             (unsigned long)pc);
+  else
+    snprintf(Name, sizeof(Name), " %s pc %lu", kind, (unsigned long)pc);
+  return "bf " + ProgramName + Name;
+}
+
+void brainf_profile_code(BrainFVM *vm, size_t pc, const char *kind,
+                         void *code, size_t size) {
+  if (vm != ProfiledVM || !code)
+    return;
+  pthread_mutex_lock(&PerfLock);
+  
+  if (PerfMap || JITDump) {
+    std::string Name = describe(vm, pc, kind);
+    if (PerfMap) {
+      fprintf(PerfMap, "%lx %lx %s\n", (unsigned long)code,
+              (unsigned long)size, Name.c_str());
+      fflush(PerfMap);
+    }
+    if (JITDump) {
+      JITDumpCodeLoad Load;
+      Load.record.id = JIT_CODE_LOAD;
+      Load.record.total_size = sizeof(Load) + Name.size() + 1 + size;
+      Load.record.timestamp = timestamp();
+      Load.pid = getpid();
+      Load.tid = syscall(SYS_gettid);
+      Load.vma = Load.code_addr = (uintptr_t)code;
+      Load.code_size = size;
+      Load.code_index = CodeIndex++;
+      fwrite(&Load, sizeof(Load), 1, JITDump);
+      fwrite(Name.c_str(), Name.size() + 1, 1, JITDump);
+      fwrite(code, size, 1, JITDump);
+      fflush(JITDump);
+    }
+  }
+  
+  unsigned Count = CodeRangeCount;
+  if (Sampling && Count != MAX_CODE_RANGES) {
+    CodeRanges[Count].begin = (uintptr_t)code;
+    CodeRanges[Count].end = (uintptr_t)code + size;
+    CodeRanges[Count].pc = pc;
+    sys::MemoryFence();
+    CodeRangeCount = Count + 1;
+  }
+  
+  pthread_mutex_unlock(&PerfLock);
+}
+
+void brainf_profile_sample(bool in_trace, void *ip) {
+  BrainFVM *VM = ProfiledVM;
+  if (!VM || !Sampling)
+    return;
+  
+  // Compiled code that is not in a range, such as the runtime functions
+  // that traces call, counts against the trace head the interpreter
+  // dispatched from.
+  size_t pc = VM->sample_pc;
+  if (in_trace) {
+    for (unsigned i = CodeRangeCount; i-- != 0; ) {
+      if ((uintptr_t)ip >= CodeRanges[i].begin &&
+          (uintptr_t)ip < CodeRanges[i].end) {
+        pc = CodeRanges[i].pc;
+        break;
+      }
+    }
+  }
+  
+  size_t Key = pc * 2 + in_trace + 1;
+  size_t Slot = (Key * 2654435761U) & (SAMPLE_SLOTS - 1);
+  for (unsigned Probes = 0; Probes != SAMPLE_SLOTS; ++Probes) {
+    if (SampleKeys[Slot] == Key) {
+      ++SampleCounts[Slot];
+      return;
+    }
+    if (!SampleKeys[Slot]) {
+      SampleKeys[Slot] = Key;
+      SampleCounts[Slot] = 1;
+      return;
+    }
+    Slot = (Slot + 1) & (SAMPLE_SLOTS - 1);
+  }
+  ++DroppedSamples;
+}
+
+/// print_report - Print the loops the samples were taken in, hottest
+/// first.
+static void print_report(raw_ostream &OS) {
+  BrainFVM *VM = ProfiledVM;
+  
+  // Sort the samples by pc, and walk the code once to find the innermost
+  // loop around each.  Samples outside any loop are kept under code_size.
+  std::vector<std::pair<size_t, size_t> > Samples;
+  for (size_t i = 0; i != SAMPLE_SLOTS; ++i)
+    if (SampleKeys[i])
+      Samples.push_back(std::make_pair(SampleKeys[i] - 1, i));
+  std::sort(Samples.begin(), Samples.end());
+  
+  std::map<size_t, LoopSamples> Loops;
+  std::vector<size_t> Open;
+  uint64_t Total = DroppedSamples;
+  size_t pc = 0;
+  for (size_t i = 0; i != Samples.size(); ++i) {
+    size_t SamplePC = Samples[i].first / 2;
+    for (; pc <= SamplePC && pc < VM->code_size; ++pc) {
+      while (!Open.empty() && VM->code[Open.back()].target < pc)
+        Open.pop_back();
+      uint8_t Opcode = VM->code[pc].opcode;
+      if (Opcode == OP_IF || Opcode == OP_TRACE)
+        Open.push_back(pc);
+    }
+    
+    size_t Loop = Open.empty() || SamplePC >= VM->code_size
+                ? VM->code_size : Open.back();
+    uint64_t Count = SampleCounts[Samples[i].second];
+    LoopSamples &L = Loops[Loop];
+    L.pc = Loop;
+    if (Samples[i].first & 1)
+      L.compiled += Count;
+    else
+      L.interpreted += Count;
+    Total += Count;
+  }
+  
+  std::vector<LoopSamples> Sorted;
+  for (std::map<size_t, LoopSamples>::iterator I = Loops.begin(),
+       E = Loops.end(); I != E; ++I)
+    Sorted.push_back(I->second);
+  std::sort(Sorted.begin(), Sorted.end());
+  
+  OS << "===" << std::string(73, '-') << "===\n"
+     << "                          ... Hot Loops of " << ProgramName
+     << " ...\n"
+     << "===" << std::string(73, '-') << "===\n\n";
+  if (!Total) {
+    OS << "  No samples were taken.\n\n";
+    return;
+  }
+  OS << "  samples      %    compiled  location\n";
+  for (size_t i = 0; i != Sorted.size() && i != REPORT_LOOPS; ++i) {
+    const LoopSamples &L = Sorted[i];
+    char Line[128];
+    int Length = snprintf(Line, sizeof(Line), "%9llu %6.2f%% %10.1f%%  ",
+                          (unsigned long long)L.total(),
+                          100.0 * L.total() / Total,
+                          100.0 * L.compiled / L.total());
+    unsigned SourceLine, Column;
+    if (L.pc == VM->code_size)
+      snprintf(Line + Length, sizeof(Line) - Length, "outside any loop");
+    else if (brainf_source_location(VM, L.pc, SourceLine, Column))
+      snprintf(Line + Length, sizeof(Line) - Length, "%s:%u:%u (pc %lu)",
+               ProgramName.c_str(), SourceLine, Column, (unsigned long)L.pc);
+    else
+      snprintf(Line + Length, sizeof(Line) - Length, "pc %lu",
+               (unsigned long)L.pc);
+    OS << Line << "\n";
+  }
+  if (DroppedSamples)
+    OS << "  " << DroppedSamples << " samples could not be attributed.\n";
+  OS << "  " << Total << " samples of the interpreter thread in all.\n\n";
+}
+
+void brainf_profile_close(raw_ostream &OS) {
+  if (!ProfiledVM)
+    return;
+  
+  pthread_mutex_lock(&PerfLock);
+  if (PerfMap) {
+    fclose(PerfMap);
+    PerfMap = 0;
+  }
+  if (JITDump) {
+    JITDumpRecord Close;
+    Close.id = JIT_CODE_CLOSE;
+    Close.total_size = sizeof(Close);
+    Close.timestamp = timestamp();
+    fwrite(&Close, sizeof(Close), 1, JITDump);
+    fclose(JITDump);
+    JITDump = 0;
+    munmap(JITDumpMarker, sysconf(_SC_PAGESIZE));
+  }
+  pthread_mutex_unlock(&PerfLock);
+  
+  if (Sampling)
+    print_report(OS);
+  ProfiledVM = 0;
+}
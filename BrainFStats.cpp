@@ -0,0 +1,251 @@
+//===-- BrainFStats.cpp - BrainF JIT statistics ---------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------===//
+//
+// The counters reported by -stats.  The recorder and the compiler thread
+// keep them all the time, as each costs no more than an increment at an
+// event that is already expensive.
+//
+// Where the time goes is measured by sampling: while -stats is given, a
+// SIGPROF timer interrupts whichever thread is using the CPU, and the
+// handler counts whether it found the compiler thread, or the interpreter
+// thread running the interpreter or a compiled trace.  The kernel only
+// delivers the signal on a scheduler tick, which may be much coarser than
+// the interval asked for, so the samples are used as proportions of the
+// CPU time the process used.  The samples of the interpreter thread are
+// also handed, with the instruction pointer they interrupted, to the
+// profiler of -profile.
+//
+// The compile time and code size of each tree are also kept apart, keyed by
+// the pc of its loop, so that the costly traces can be told from the rest.
+//===--------------------------------------------------------------------===//
+
+#include "BrainFVM.h"
+#include "llvm/Support/raw_ostream.h"
+#include <csignal>
+#include <cstdio>
+#include <map>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+BrainFStats Stats;
+
+/// SAMPLE_USEC - The interval between samples, in microseconds of CPU time.
+#define SAMPLE_USEC 1000
+
+static pthread_t InterpreterThread;
+static struct sigaction OldAction;
+static struct rusage StartUsage;
+
+// The samples taken in each of the three places.
+static volatile uint64_t InterpretingSamples, TracingSamples,
+                         CompilingSamples;
+
+namespace {
+  /// TraceCost - What compiling the tree of one loop has cost, over every
+  /// compile of it and of its branches.
+  struct TraceCost {
+    uint64_t compiles;
+    uint64_t optimize_usec;
+    uint64_t codegen_usec;
+    uint64_t code_bytes;
+    TraceCost() : compiles(0), optimize_usec(0), codegen_usec(0),
+                  code_bytes(0) { }
+  };
+}
+
+// The cost of each tree, by the pc of its loop.  The compiler threads of
+// several VMs may add to it at once, so it is kept under TraceCostLock.
+static pthread_mutex_t TraceCostLock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<size_t, TraceCost> TraceCosts;
+
+/// interrupted_ip - The instruction pointer saved in the signal context,
+/// where the platform is known, and otherwise null.
+static void *interrupted_ip(void *context) {
+#if defined(__linux__) && defined(__x86_64__)
+  return (void*)((ucontext_t*)context)->uc_mcontext.gregs[REG_RIP];
+#elif defined(__linux__) && defined(__i386__)
+  return (void*)((ucontext_t*)context)->uc_mcontext.gregs[REG_EIP];
+#else
+  return 0;
+#endif
+}
+
+static void sample(int, siginfo_t *, void *context) {
+  if (!pthread_equal(pthread_self(), InterpreterThread)) {
+    ++CompilingSamples;
+    return;
+  }
+  
+  bool InTrace = Stats.in_trace;
+  if (InTrace)
+    ++TracingSamples;
+  else
+    ++InterpretingSamples;
+  brainf_profile_sample(InTrace, interrupted_ip(context));
+}
+
+/// cpu_usec - The user and system time recorded in usage, in microseconds.
+static uint64_t cpu_usec(const struct rusage &usage) {
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+void brainf_stats_compile(size_t pc, uint64_t optimize_usec,
+                          uint64_t codegen_usec, size_t code_bytes) {
+  pthread_mutex_lock(&TraceCostLock);
+  TraceCost &Cost = TraceCosts[pc];
+  ++Cost.compiles;
+  Cost.optimize_usec += optimize_usec;
+  Cost.codegen_usec += codegen_usec;
+  Cost.code_bytes += code_bytes;
+  pthread_mutex_unlock(&TraceCostLock);
+}
+
+void brainf_sampler_start() {
+  InterpreterThread = pthread_self();
+  getrusage(RUSAGE_SELF, &StartUsage);
+  
+  struct sigaction Action;
+  memset(&Action, 0, sizeof(Action));
+  Action.sa_sigaction = sample;
+  Action.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigemptyset(&Action.sa_mask);
+  sigaction(SIGPROF, &Action, &OldAction);
+  
+  struct itimerval Timer;
+  Timer.it_interval.tv_sec = 0;
+  Timer.it_interval.tv_usec = SAMPLE_USEC;
+  Timer.it_value = Timer.it_interval;
+  setitimer(ITIMER_PROF, &Timer, 0);
+}
+
+void brainf_sampler_stop() {
+  struct itimerval Timer;
+  memset(&Timer, 0, sizeof(Timer));
+  setitimer(ITIMER_PROF, &Timer, 0);
+  sigaction(SIGPROF, &OldAction, 0);
+  
+  struct rusage Usage;
+  getrusage(RUSAGE_SELF, &Usage);
+  uint64_t Samples = InterpretingSamples + TracingSamples + CompilingSamples;
+  if (!Samples)
+    return;
+  
+  uint64_t CPUMsec = (cpu_usec(Usage) - cpu_usec(StartUsage)) / 1000;
+  Stats.interpreting_ms = CPUMsec * InterpretingSamples / Samples;
+  Stats.tracing_ms = CPUMsec * TracingSamples / Samples;
+  Stats.compiling_ms = CPUMsec * CompilingSamples / Samples;
+}
+
+namespace {
+  /// StatInfo - The name and description under which a counter is printed.
+  struct StatInfo {
+    const char *name;
+    const char *desc;
+    uint64_t BrainFStats::*field;
+  };
+}
+
+static const StatInfo StatTable[] = {
+  { "traces_recorded", "Trace trees recorded",
+    &BrainFStats::traces_recorded },
+  { "extensions_recorded", "Extensions recorded onto trace trees",
+    &BrainFStats::extensions_recorded },
+  { "recordings_aborted", "Recordings abandoned",
+    &BrainFStats::recordings_aborted },
+  { "trace_entries", "Entries into compiled traces from the interpreter",
+    &BrainFStats::trace_entries },
+  { "tier1_compiles", "Trees compiled in tier 1",
+    &BrainFStats::tier1_compiles },
+  { "tier2_compiles", "Trees compiled in tier 2",
+    &BrainFStats::tier2_compiles },
+  { "relink_compiles", "Recompilations to link side exits",
+    &BrainFStats::relink_compiles },
+  { "branch_compiles", "Extensions compiled as branches of their trees",
+    &BrainFStats::branch_compiles },
+  { "optimize_usec", "Microseconds spent optimizing IR",
+    &BrainFStats::optimize_usec },
+  { "codegen_usec", "Microseconds spent generating machine code",
+    &BrainFStats::codegen_usec },
+  { "code_bytes", "Bytes of machine code emitted",
+    &BrainFStats::code_bytes },
+  { "code_peak_bytes", "Most bytes of machine code live at once",
+    &BrainFStats::code_peak_bytes },
+  { "traces_freed", "Superseded trace versions freed",
+    &BrainFStats::traces_freed },
+  { "first_trace_usec", "Microseconds until the first trace was installed",
+    &BrainFStats::first_trace_usec },
+  { "ops_executed", "Instructions interpreted, with -count-ops",
+    &BrainFStats::ops_executed },
+  { "interpreting_ms", "Milliseconds of CPU time spent interpreting",
+    &BrainFStats::interpreting_ms },
+  { "tracing_ms", "Milliseconds of CPU time spent in compiled traces",
+    &BrainFStats::tracing_ms },
+  { "compiling_ms", "Milliseconds of CPU time spent in the compiler thread",
+    &BrainFStats::compiling_ms }
+};
+
+void brainf_print_stats(raw_ostream &OS, bool json) {
+  const unsigned Count = sizeof(StatTable) / sizeof(StatTable[0]);
+  
+  if (json) {
+    OS << "{";
+    for (unsigned i = 0; i != Count; ++i) {
+      OS << (i ? ", " : "") << '"' << StatTable[i].name << "\": "
+         << (unsigned long long)(Stats.*StatTable[i].field);
+    }
+    OS << ", \"traces\": [";
+    for (std::map<size_t, TraceCost>::iterator I = TraceCosts.begin(),
+         E = TraceCosts.end(); I != E; ++I) {
+      OS << (I != TraceCosts.begin() ? ", " : "") << "{\"pc\": "
+         << (unsigned long long)I->first << ", \"compiles\": "
+         << (unsigned long long)I->second.compiles << ", \"optimize_usec\": "
+         << (unsigned long long)I->second.optimize_usec
+         << ", \"codegen_usec\": "
+         << (unsigned long long)I->second.codegen_usec
+         << ", \"code_bytes\": "
+         << (unsigned long long)I->second.code_bytes << "}";
+    }
+    OS << "]}\n";
+    return;
+  }
+  
+  // Match the layout of LLVM's own -stats output.
+  OS << "===" << std::string(73, '-') << "===\n"
+     << "                          ... Statistics Collected ...\n"
+     << "===" << std::string(73, '-') << "===\n\n";
+  for (unsigned i = 0; i != Count; ++i) {
+    char Value[24];
+    snprintf(Value, sizeof(Value), "%12llu",
+             (unsigned long long)(Stats.*StatTable[i].field));
+    OS << Value << " " << StatTable[i].name << " - " << StatTable[i].desc
+       << "\n";
+  }
+  OS << "\n";
+  
+  if (TraceCosts.empty())
+    return;
+  OS << "===" << std::string(73, '-') << "===\n"
+     << "                          ... Compile Costs by Trace ...\n"
+     << "===" << std::string(73, '-') << "===\n\n"
+     << "    loop pc   compiles  optimize_usec   codegen_usec     code_bytes\n";
+  for (std::map<size_t, TraceCost>::iterator I = TraceCosts.begin(),
+       E = TraceCosts.end(); I != E; ++I) {
+    char Line[96];
+    snprintf(Line, sizeof(Line), "%11llu %10llu %14llu %14llu %14llu",
+             (unsigned long long)I->first,
+             (unsigned long long)I->second.compiles,
+             (unsigned long long)I->second.optimize_usec,
+             (unsigned long long)I->second.codegen_usec,
+             (unsigned long long)I->second.code_bytes);
+    OS << Line << "\n";
+  }
+  OS << "\n";
+}
@@ -0,0 +1,158 @@
+//===-- BrainFTape.cpp - BrainF growable tape ----------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------===//
+//
+// The tape is a large region of address space reserved with mmap, of which
+// only a window around the cells the program has touched is accessible.
+// Touching a cell outside of the window faults, and a SIGSEGV handler grows
+// the window to cover it before the access is retried.  Neither the
+// interpreter nor compiled traces ever check the data pointer against the
+// bounds of the tape.
+//
+// The first and last pages of the region are never made accessible.  A
+// program that runs into one of them has moved left of the cells reserved
+// by -tape-offset, or off the far end of the tape, and is stopped rather
+// than being allowed to corrupt memory: the handler jumps back out to
+// brainf_vm_run, which reports the error.
+//
+// Each VM has a tape of its own, and a fault can only come from the VM
+// running on the faulting thread, so one handler serves all of them.
+//===--------------------------------------------------------------------===//
+
+#include "BrainFVM.h"
+#include <csignal>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/// TAPE_CHUNK - The minimum amount by which the accessible window grows.
+#define TAPE_CHUNK (1 << 20)
+
+__thread BrainFVM *RunningVM = 0;
+
+static size_t PageSize;
+
+// The handler that was installed before ours, and the number of tapes that
+// are using ours.
+static struct sigaction OldAction;
+static unsigned TapeCount;
+static pthread_mutex_t HandlerLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// grow_tape - Extend the accessible window of tape to include the page at
+/// offset, at least doubling it so that a program walking the tape faults
+/// only a logarithmic number of times.
+static bool grow_tape(BrainFTape &tape, size_t offset) {
+  size_t Lo = PageSize, Hi = tape.size - PageSize;
+  if (offset < Lo || offset >= Hi ||
+      (offset >= tape.commit_begin && offset < tape.commit_end))
+    return false;
+  
+  size_t Grow = tape.commit_end - tape.commit_begin;
+  if (Grow < TAPE_CHUNK) Grow = TAPE_CHUNK;
+  
+  size_t Begin = tape.commit_begin, End = tape.commit_end;
+  if (offset < tape.commit_begin) {
+    Begin = offset - offset % PageSize;
+    if (tape.commit_begin - Begin < Grow)
+      Begin = tape.commit_begin - Lo < Grow ? Lo : tape.commit_begin - Grow;
+  } else {
+    End = offset - offset % PageSize + PageSize;
+    if (End - tape.commit_end < Grow)
+      End = Hi - tape.commit_end < Grow ? Hi : tape.commit_end + Grow;
+  }
+  
+  if (mprotect(tape.base + Begin, End - Begin, PROT_READ | PROT_WRITE))
+    return false;
+  tape.commit_begin = Begin;
+  tape.commit_end = End;
+  return true;
+}
+
+/// tape_fault - The SIGSEGV handler.  Faults outside of the tape of the VM
+/// running on this thread are passed on to the handler that was installed
+/// before ours.
+static void tape_fault(int sig, siginfo_t *info, void *context) {
+  uint8_t *addr = (uint8_t*)info->si_addr;
+  BrainFVM *VM = RunningVM;
+  if (VM && addr >= VM->tape.base && addr < VM->tape.base + VM->tape.size) {
+    if (!grow_tape(VM->tape, addr - VM->tape.base))
+      siglongjmp(VM->tape_exit, 1);
+    return;
+  }
+  
+  if (OldAction.sa_flags & SA_SIGINFO) {
+    OldAction.sa_sigaction(sig, info, context);
+  } else if (OldAction.sa_handler != SIG_IGN &&
+             OldAction.sa_handler != SIG_DFL) {
+    OldAction.sa_handler(sig);
+  } else {
+    // Returning retries the access, which now faults with the default
+    // action.
+    sigaction(SIGSEGV, &OldAction, 0);
+  }
+}
+
+uint8_t *brainf_tape_create(BrainFTape &tape, size_t start_offset,
+                            bool huge_pages) {
+  pthread_mutex_lock(&HandlerLock);
+  if (!TapeCount++) {
+    PageSize = sysconf(_SC_PAGESIZE);
+    
+    struct sigaction Action;
+    memset(&Action, 0, sizeof(Action));
+    Action.sa_sigaction = &tape_fault;
+    Action.sa_flags = SA_SIGINFO;
+    sigemptyset(&Action.sa_mask);
+    sigaction(SIGSEGV, &Action, &OldAction);
+  }
+  pthread_mutex_unlock(&HandlerLock);
+  
+  // The starting cell sits so that exactly start_offset cells lie between
+  // it and the lower guard page.
+  size_t Start = PageSize + start_offset;
+  tape.size = (Start + TAPE_RESERVE + PageSize - 1) / PageSize * PageSize +
+              PageSize;
+  
+  void *Region = mmap(0, tape.size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (Region == MAP_FAILED) {
+    perror("Error: could not reserve the tape");
+    exit(1);
+  }
+  tape.base = (uint8_t*)Region;
+  tape.begin = tape.base + PageSize;
+  tape.end = tape.base + tape.size - PageSize;
+  
+#if defined(MADV_HUGEPAGE)
+  if (huge_pages)
+    madvise(tape.base, tape.size, MADV_HUGEPAGE);
+#else
+  (void)huge_pages;
+#endif
+  
+  // Make the first chunks on either side of the starting cell accessible up
+  // front.
+  tape.commit_begin = tape.commit_end = Start - Start % PageSize;
+  grow_tape(tape, Start);
+  if (start_offset && Start - 1 < tape.commit_begin)
+    grow_tape(tape, Start - 1);
+  
+  return tape.base + Start;
+}
+
+void brainf_tape_destroy(BrainFTape &tape) {
+  munmap(tape.base, tape.size);
+  tape.base = 0;
+  
+  pthread_mutex_lock(&HandlerLock);
+  if (!--TapeCount)
+    sigaction(SIGSEGV, &OldAction, 0);
+  pthread_mutex_unlock(&HandlerLock);
+}
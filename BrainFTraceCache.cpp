@@ -0,0 +1,205 @@
+//===-- BrainFTraceCache.cpp - BrainF persistent trace cache -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------===//
+//
+// This file saves the committed trace trees of a run to disk, and restores
+// them at the start of later runs of the same program.  Restored trees are
+// queued for compilation straight away, so the loops they cover run native
+// code without first being counted and recorded again.
+//
+// Trees are cached rather than compiled code: the generated code refers to
+// its live tree and to the recorder by address, and these differ from run
+// to run.  Trees that had been promoted to tier 2 are restored in tier 2.
+//
+// A cache file holds a header followed by the trees:
+//   header - "BFTC", a 32-bit version, the 64-bit program key, and a
+//            32-bit count of trees
+//   tree   - the 8-bit tier of the tree and a 32-bit count of its nodes,
+//            followed by the nodes in the order they are stored in
+//   node   - the 8-bit opcode, and the 32-bit pc, left and right links
+// Links are written as they are stored in memory.  Every child is stored
+// after its parent, and every node must fit the instruction at its pc,
+// which is checked when a tree is read back.
+//===--------------------------------------------------------------------===//
+
+#include "BrainF.h"
+#include "BrainFVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <cstdio>
+#include <unistd.h>
+
+#define CACHE_VERSION 2
+
+static const char CacheMagic[4] = { 'B', 'F', 'T', 'C' };
+
+/// append - Append an integer to buf in host byte order.
+template<typename T>
+static void append(std::vector<uint8_t> &buf, T value) {
+  const uint8_t *bytes = (const uint8_t*)&value;
+  buf.insert(buf.end(), bytes, bytes + sizeof(T));
+}
+
+/// extract - Read an integer written by append() from cur, returning false
+/// if it would run past end.
+template<typename T>
+static bool extract(const uint8_t *&cur, const uint8_t *end, T &value) {
+  if ((size_t)(end - cur) < sizeof(T))
+    return false;
+  memcpy(&value, cur, sizeof(T));
+  cur += sizeof(T);
+  return true;
+}
+
+/// matches - Whether a trace node with the given opcode can stand for the
+/// instruction insn.  A call stands for the whole loop it calls.
+static bool matches(uint8_t opcode, const BrainFInsn &insn) {
+  switch (opcode) {
+    case '+': return insn.opcode == OP_ADD;
+    case '>': return insn.opcode == OP_MOVE;
+    case 's': return insn.opcode == OP_SCAN;
+    case '*': return insn.opcode == OP_MUL;
+    case '.': return insn.opcode == OP_PUT;
+    case ',': return insn.opcode == OP_GET;
+    case '0': return insn.opcode == OP_SET_ZERO;
+    case ']': return insn.opcode == OP_BACK;
+    case '[':
+    case 'T': return insn.opcode == OP_IF || insn.opcode == OP_TRACE;
+    default:  return false;
+  }
+}
+
+/// successor - The pc that node goes on to along its right link if right,
+/// or else its left link.  The right link of a branch or call is taken once
+/// its loop is done, and that of a back-edge returns to the '['.  A left
+/// link always goes on to the next instruction, and a back-edge has none.
+size_t BrainFTraceRecorder::successor(const BrainFTraceNode &node,
+                                      bool right) {
+  if (node.opcode == ']')
+    return right ? VM->code[node.pc].target : ~(size_t)0;
+  return right ? VM->code[node.pc].target+1 : node.pc+1;
+}
+
+bool BrainFTraceRecorder::load_cache(const std::string &path, uint64_t key) {
+  MemoryBuffer *File = MemoryBuffer::getFile(path);
+  if (!File)
+    return false;
+  
+  const uint8_t *cur = (const uint8_t*)File->getBufferStart();
+  const uint8_t *end = (const uint8_t*)File->getBufferEnd();
+  uint32_t version, count;
+  uint64_t file_key;
+  bool valid = (size_t)(end - cur) >= sizeof(CacheMagic) &&
+               !memcmp(cur, CacheMagic, sizeof(CacheMagic));
+  if (valid) {
+    cur += sizeof(CacheMagic);
+    valid = extract(cur, end, version) && version == CACHE_VERSION &&
+            extract(cur, end, file_key) && file_key == key &&
+            extract(cur, end, count);
+  }
+  
+  // Decode every tree before installing any, so that a damaged file is
+  // ignored as a whole.
+  std::vector<BrainFTrace*> Trees;
+  for (uint32_t i = 0; valid && i != count; ++i) {
+    BrainFTrace *Tree = new BrainFTrace();
+    Trees.push_back(Tree);
+    
+    uint32_t size;
+    valid = extract(cur, end, Tree->tier) &&
+            (Tree->tier == 1 || Tree->tier == 2) &&
+            extract(cur, end, size) && size && size <= MAX_TREE_SIZE;
+    for (uint32_t n = 0; valid && n != size; ++n) {
+      uint8_t opcode;
+      uint32_t pc, left, right;
+      valid = extract(cur, end, opcode) && extract(cur, end, pc) &&
+              extract(cur, end, left) && extract(cur, end, right) &&
+              pc < VM->code_size && matches(opcode, VM->code[pc]);
+      
+      // Only branches, calls and back-edges leave by their right link.
+      if (valid && right != UNTRACED && opcode != '[' && opcode != 'T' &&
+          opcode != ']')
+        valid = false;
+      if (!valid) break;
+      Tree->nodes.push_back(BrainFTraceNode(opcode, pc, 0));
+      Tree->nodes.back().left = left;
+      Tree->nodes.back().right = right;
+    }
+    if (!valid || Tree->root().opcode != '[' ||
+        VM->code[Tree->root().pc].opcode != OP_IF)
+      valid = false;
+    
+    // Children must follow their parents, which also rules out cycles, and
+    // each link must lead to the pc its node goes on to along that edge.
+    // Depths are recomputed on the way.
+    for (uint32_t n = 0; valid && n != size; ++n) {
+      BrainFTraceNode &Node = Tree->nodes[n];
+      uint32_t Links[2] = { Node.left, Node.right };
+      for (unsigned l = 0; valid && l != 2; ++l) {
+        if (Links[l] == UNTRACED)
+          continue;
+        size_t Next = successor(Node, l);
+        if (Links[l] == TRACE_HEAD) {
+          valid = Next == Tree->root().pc;
+          continue;
+        }
+        valid = Links[l] > n && Links[l] < size &&
+                Tree->nodes[Links[l]].pc == Next;
+        if (valid) Tree->nodes[Links[l]].depth = Node.depth+1;
+      }
+    }
+  }
+  delete File;
+  
+  if (!valid) {
+    for (unsigned i = 0, e = Trees.size(); i != e; ++i)
+      delete Trees[i];
+    return false;
+  }
+  
+  for (unsigned i = 0, e = Trees.size(); i != e; ++i) {
+    trace_map[Trees[i]->root().pc] = Trees[i];
+    schedule_compile(Trees[i]);
+  }
+  return true;
+}
+
+void BrainFTraceRecorder::save_cache(const std::string &path, uint64_t key) {
+  if (trace_map.empty())
+    return;
+  
+  std::vector<uint8_t> buf(CacheMagic, CacheMagic + sizeof(CacheMagic));
+  append<uint32_t>(buf, CACHE_VERSION);
+  append<uint64_t>(buf, key);
+  append<uint32_t>(buf, trace_map.size());
+  for (DenseMap<size_t, BrainFTrace*>::iterator I = trace_map.begin(),
+       E = trace_map.end(); I != E; ++I) {
+    std::vector<BrainFTraceNode> &Nodes = I->second->nodes;
+    append<uint8_t>(buf, I->second->tier);
+    append<uint32_t>(buf, Nodes.size());
+    for (unsigned n = 0, e = Nodes.size(); n != e; ++n) {
+      append<uint8_t>(buf, Nodes[n].opcode);
+      append<uint32_t>(buf, Nodes[n].pc);
+      append<uint32_t>(buf, Nodes[n].left);
+      append<uint32_t>(buf, Nodes[n].right);
+    }
+  }
+  
+  // Write to a private file and rename it into place, so that concurrent
+  // runs of the same program never see a partially written cache.
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+  std::string tmp_path = path + suffix;
+  FILE *File = fopen(tmp_path.c_str(), "wb");
+  if (!File)
+    return;
+  bool written = fwrite(&buf[0], 1, buf.size(), File) == buf.size();
+  if (fclose(File) == 0 && written)
+    rename(tmp_path.c_str(), path.c_str());
+  else
+    remove(tmp_path.c_str());
+}
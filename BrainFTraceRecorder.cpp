@@ -12,16 +12,17 @@
 //
 // The operation of the recorder can be divided into four parts:
 //   1) Interation Counting - To identify hot traces, we track the execution
-//      counts of all loop headers ('[' instructions).  We use a fixed-size
-//      array of counters for this, since lack of precision does not affect
-//      correctness.
+//      counts of all loop headers ('[' instructions).  Each header has its
+//      own counter, kept in the instruction itself next to its jump target.
 //
 //   2) Trace Buffering - Once a header has passed a hotness threshold, we 
 //      begin buffering the execution trace beginning from that header the
 //      next time it is executed.  This buffer is of a fixed length, though
 //      that choice can be tuned for performance.  If the end of the buffer
 //      is reached without execution returning to the header, we throw out
-//      the trace.
+//      the trace.  Each time this happens, the threshold for the header is
+//      doubled, so loops that do not trace well are retried less and less
+//      often, but are never given up on altogether.
 //
 //   3) Trace Commit - If the buffered trace returns to the header before 
 //      the buffer limit is reached, that trace is commited to form a trace
@@ -30,124 +31,365 @@
 //      threshold.  The buffer is then cleared to allow a new trace to be
 //      recorded.
 //
+//      A trace that reaches the head of a loop which already has a compiled
+//      trace records a call to it, rather than the iterations of the inner
+//      loop, so that loop nests can be traced from the outside in.
+//
 //   4) Trace Compilation - Once a secondary hotness threshold is reached,
-//      trace recording is terminated and the set of observed traces encoded
-//      in the trace tree are compiled to native code, and a function pointer
-//      to that trace is installed into the bytecode array in place of one of
-//      the normal opcode functions.  Details of this compilation are in
-//      BrainFCodeGen.cpp
+//      trace recording is terminated and a snapshot of the trace tree is
+//      queued for compilation to native code on a background thread, while
+//      the interpreter carries on executing the bytecode.  When compilation
+//      finishes, a function pointer to that trace is installed into the
+//      trace array, and the opcode at the trace head is replaced to dispatch
+//      to it.  Trees are first compiled cheaply, and recompiled with full
+//      optimization once their compiled code has itself become hot.
+//      Details of this compilation are in BrainFCodeGen.cpp
 //===--------------------------------------------------------------------===//
 
 #include "BrainF.h"
 #include "BrainFVM.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 
-#define ITERATION_BUF_SIZE  1024
-#define TRACE_BUF_SIZE       128
-#define TRACE_THRESHOLD      100
-#define BACKEDGE_THRESHOLD     5
-
-void BrainFTraceRecorder::BrainFTraceNode::dump(unsigned lvl) {
+void BrainFTraceRecorder::BrainFTrace::dump(uint32_t node, unsigned lvl) {
   for (unsigned i = 0; i < lvl; ++i)
     outs() << '.';
-  outs() << opcode << " : " << pc << "\n";
-  if (left && left != (BrainFTraceNode*)~0ULL) left->dump(lvl+1);
-  if (right && right != (BrainFTraceNode*)~0ULL) right->dump(lvl+1);
+  const BrainFTraceNode &Node = nodes[node];
+  outs() << Node.opcode << " : " << Node.pc << "\n";
+  if (Node.left != UNTRACED && Node.left != TRACE_HEAD) dump(Node.left, lvl+1);
+  if (Node.right != UNTRACED && Node.right != TRACE_HEAD)
+    dump(Node.right, lvl+1);
 }
 
-BrainFTraceRecorder::BrainFTraceRecorder()
-  : mode(MODE_PROFILING), iteration_count(new uint8_t[ITERATION_BUF_SIZE]),
+BrainFTraceRecorder::BrainFTraceRecorder(BrainFVM *vm, bool jit)
+  : VM(vm), mode(MODE_PROFILING), jit_enabled(jit), extension_root(0),
     trace_begin(new std::pair<uint8_t, size_t>[TRACE_BUF_SIZE]),
     trace_end(trace_begin + TRACE_BUF_SIZE),
-    trace_tail(trace_begin),
-    module(new Module("BrainF", getGlobalContext())) {
-  memset(iteration_count, 0, ITERATION_BUF_SIZE);
+    trace_tail(trace_begin), record_limit(trace_begin), record_head(~0ULL),
+    Slots(0), Walking(false), NextLink(UNTRACED), int_type(0), op_type(0),
+    Tier(0), compile_thread_started(false), shutting_down(false) {
   memset(trace_begin, 0, sizeof(std::pair<uint8_t, size_t>) * TRACE_BUF_SIZE);
   
-  initialize_module();
+  pthread_mutex_init(&queue_lock, 0);
+  pthread_cond_init(&queue_cond, 0);
 }
 
 BrainFTraceRecorder::~BrainFTraceRecorder() {
-  delete[] iteration_count;
+  // Stop the compiler thread, abandoning any trees it has not started on.
+  pthread_mutex_lock(&queue_lock);
+  shutting_down = true;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+  if (compile_thread_started)
+    pthread_join(compile_thread, 0);
+  
+  while (!compile_queue.empty()) {
+    delete compile_queue.front();
+    compile_queue.pop_front();
+  }
+  for (DenseMap<BrainFTrace*, BrainFCompiledTrace>::iterator
+       I = compiled.begin(), E = compiled.end(); I != E; ++I)
+    delete I->second.snapshot;
+  pthread_cond_destroy(&queue_cond);
+  pthread_mutex_destroy(&queue_lock);
+  
   delete[] trace_begin;
-  delete FPM;
-  delete EE;
+  for (DenseMap<size_t, BrainFTrace*>::iterator I = trace_map.begin(),
+       E = trace_map.end(); I != E; ++I)
+    delete I->second;
+  
+  // Free what is left of the trace code, so that the code size statistics
+  // stay true for other VMs in the process.
+  while (!versions.empty()) {
+    BrainFCodeVersion *Version = versions.begin()->second;
+    free_version(Version);
+    delete Version;
+  }
+  for (unsigned i = 0; i != 2; ++i) {
+    delete tiers[i].FPM;
+    delete tiers[i].EE;
+  }
 }
 
-void BrainFTraceRecorder::commit() {
-  BrainFTraceNode *&Head = trace_map[trace_begin->second];
-  if (!Head)
-    Head = new BrainFTraceNode(trace_begin->first, trace_begin->second, 0);
+/// set_mode - Switch the recorder to a new mode, updating the bounds used
+/// by the inline fast path of record_simple.
+void BrainFTraceRecorder::set_mode(uint8_t new_mode) {
+  mode = new_mode;
+  if (mode == MODE_RECORDING) {
+    record_limit = trace_end;
+    record_head = trace_begin->second;
+  } else if (mode == MODE_EXTENSION) {
+    size_t depth = extension_root->nodes[extension_leaf].depth;
+    record_limit = depth < TRACE_BUF_SIZE ? trace_end - depth : trace_begin;
+    record_head = extension_root->root().pc;
+  } else {
+    record_limit = trace_begin;
+    record_head = ~0ULL;
+  }
+}
+
+/// begin_trace - Start recording a trace whose head is the loop header at pc.
+void BrainFTraceRecorder::begin_trace(size_t pc) {
+  // Without the JIT, back the header off as far as it goes, so that it
+  // comes back here as rarely as possible.
+  if (!jit_enabled) {
+    VM->code[pc].count = 0;
+    VM->code[pc].trace_backoff = MAX_BACKOFF;
+    return;
+  }
+  
+  // A header that already has a tree is waiting for the compiler thread to
+  // install it.  Restart its count rather than recording it again.
+  if (trace_map.count(pc)) {
+    VM->code[pc].count = 0;
+    return;
+  }
+  
+  trace_begin->first = '[';
+  trace_begin->second = pc;
+  trace_tail = trace_begin+1;
+  backedge_count = 0;
+  backedge_limit = BACKEDGE_THRESHOLD << VM->code[pc].backedge_backoff;
+  set_mode(MODE_RECORDING);
+}
+
+/// begin_extension - Start recording an extension from the side exit which
+/// has just resumed the interpreter at pc, unless that exit is blacklisted.
+/// Returns true if recording has begun.
+bool BrainFTraceRecorder::begin_extension(size_t pc) {
+  DenseMap<size_t, BrainFBlacklistEntry>::iterator I = blacklist.find(pc);
+  if (I != blacklist.end() && I->second.skip) {
+    --I->second.skip;
+    set_mode(MODE_PROFILING);
+    return false;
+  }
   
-  BrainFTraceNode *Parent = Head;
-  std::pair<uint8_t, size_t> *trace_iter = trace_begin+1;
-  unsigned depth = 0;
+  // Stop extending a tree once it is as large as we allow trees to grow.
+  // A call is extended from whichever of its returns was not traced, but
+  // not from a call to a trace that was not compiled yet when the tree was,
+  // which exits at the call itself.
+  const BrainFTraceNode &Leaf = extension_root->nodes[extension_leaf];
+  if (extension_root->nodes.size() + TRACE_BUF_SIZE > MAX_TREE_SIZE ||
+      (Leaf.opcode == 'T' && pc == Leaf.pc)) {
+    set_mode(MODE_PROFILING);
+    return false;
+  }
+  
+  trace_tail = trace_begin;
+  extension_pc = pc;
+  backedge_count = 0;
+  backedge_limit =
+    BACKEDGE_THRESHOLD << VM->code[extension_root->root().pc].backedge_backoff;
+  set_mode(MODE_EXTENSION);
+  return true;
+}
+
+/// abort_recording - Throw away the trace being recorded, and back off
+/// before recording from the same place again.  A loop header's threshold
+/// is doubled, and if the trace ran through too many inner loop iterations,
+/// so is the number it may run through next time, up to MAX_BACKEDGE_BACKOFF
+/// doublings: any more would let the trace buffer fill first, as each
+/// iteration takes up a slot in it.  A side exit is blacklisted for twice as
+/// long as it was the last time.
+void BrainFTraceRecorder::abort_recording(bool too_many_backedges) {
+  if (mode == MODE_RECORDING || mode == MODE_EXTENSION)
+    ++Stats.recordings_aborted;
+  
+  if (mode == MODE_RECORDING) {
+    BrainFInsn &Head = VM->code[trace_begin->second];
+    Head.count = 0;
+    if (Head.trace_backoff < MAX_BACKOFF)
+      ++Head.trace_backoff;
+    if (too_many_backedges && Head.backedge_backoff < MAX_BACKEDGE_BACKOFF)
+      ++Head.backedge_backoff;
+  } else if (mode == MODE_EXTENSION) {
+    BrainFBlacklistEntry &Entry = blacklist[extension_pc];
+    Entry.skip = BLACKLIST_PERIOD << Entry.backoff;
+    if (Entry.backoff < MAX_BACKOFF)
+      ++Entry.backoff;
+  }
+  
+  backedge_count = 0;
+  set_mode(MODE_PROFILING);
+}
+
+/// commit_path - Merge the buffered trace from trace_iter to trace_tail into
+/// tree, as a path beginning at the node parent and returning to the head.
+void BrainFTraceRecorder::commit_path(BrainFTrace *tree, uint32_t parent,
+                                      std::pair<uint8_t, size_t> *trace_iter) {
+  std::vector<BrainFTraceNode> &Nodes = tree->nodes;
+  size_t depth = Nodes[parent].depth;
   while (trace_iter != trace_tail) {
     ++depth;
-    BrainFTraceNode *Child = 0;
+    BrainFTraceNode &Parent = Nodes[parent];
+    uint32_t &Link =
+      trace_iter->second == Parent.pc+1 ? Parent.left : Parent.right;
     
-    if (trace_iter->second == Parent->pc+1) {
-      if (Parent->left) Child = Parent->left;
-      else Child = Parent->left =
-        new BrainFTraceNode(trace_iter->first, trace_iter->second, depth);
-    } else {
-      if (Parent->right) Child = Parent->right;
-      else Child = Parent->right =
-        new BrainFTraceNode(trace_iter->first, trace_iter->second, depth);
+    // Appending to the tree may move the parent, so take the new node's
+    // index before creating it.
+    uint32_t Child = Link;
+    if (Child == UNTRACED) {
+      Child = Link = Nodes.size();
+      Nodes.push_back(BrainFTraceNode(trace_iter->first, trace_iter->second,
+                                      depth));
     }
     
-    Parent = Child;
+    parent = Child;
     ++trace_iter;
   }
   
-  if (Parent->pc+1 == Head->pc)
-    Parent->left = (BrainFTraceNode*)~0ULL;
+  if (Nodes[parent].pc+1 == tree->root().pc)
+    Nodes[parent].left = TRACE_HEAD;
   else
-    Parent->right = (BrainFTraceNode*)~0ULL;
+    Nodes[parent].right = TRACE_HEAD;
+}
+
+void BrainFTraceRecorder::commit() {
+  BrainFTrace *&Tree = trace_map[trace_begin->second];
+  if (!Tree) {
+    Tree = new BrainFTrace();
+    Tree->nodes.push_back(BrainFTraceNode(trace_begin->first,
+                                          trace_begin->second, 0));
+  }
+  commit_path(Tree, 0, trace_begin+1);
+  ++Stats.traces_recorded;
+  
+  // The loops enclosing this one may have failed to trace because of it.
+  // Now that they can record calls to it, give them a fresh start.  Each
+  // ']' knows the loop around it, so this only visits those loops.
+  size_t pc = trace_begin->second;
+  for (int32_t Outer; (Outer = VM->code[VM->code[pc].target].offset) >= 0; ) {
+    pc = Outer;
+    VM->code[pc].count = 0;
+    VM->code[pc].trace_backoff = 0;
+  }
 }
 
 void BrainFTraceRecorder::commit_extension() {
-  BrainFTraceNode *Parent = extension_leaf;
-  unsigned depth = extension_leaf->depth;
-  std::pair<uint8_t, size_t> *trace_iter = trace_begin;
-  while (trace_iter != trace_tail) {
-    ++depth;
-    BrainFTraceNode *Child = 0;
+  commit_path(extension_root, extension_leaf, trace_begin);
+  ++Stats.extensions_recorded;
+}
+
+/// schedule_compile - Queue a snapshot of tree for the compiler thread.
+void BrainFTraceRecorder::schedule_compile(BrainFTrace *tree) {
+  BrainFTrace *trace = new BrainFTrace(*tree);
+  
+  pthread_mutex_lock(&queue_lock);
+  
+  // A newer snapshot of a tree supersedes one still waiting in the queue.
+  for (std::deque<BrainFTrace*>::iterator I = compile_queue.begin(),
+       E = compile_queue.end(); I != E; ++I) {
+    if ((*I)->original == tree) {
+      delete *I;
+      *I = trace;
+      trace = 0;
+      break;
+    }
+  }
+  if (trace) compile_queue.push_back(trace);
+  
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+  
+  if (!compile_thread_started) {
+    pthread_create(&compile_thread, 0, &compile_thread_main, this);
+    compile_thread_started = true;
+  }
+}
+
+/// promote - Called by tier 1 code when tree has run TIER2_THRESHOLD
+/// iterations, to queue its recompilation in tier 2.  Runs on the
+/// interpreter thread, like the rest of the recorder.
+void BrainFTraceRecorder::promote(BrainFTraceRecorder *recorder,
+                                  BrainFTrace *tree) {
+  tree->tier = 2;
+  recorder->schedule_compile(tree);
+}
+
+void *BrainFTraceRecorder::compile_thread_main(void *recorder) {
+  ((BrainFTraceRecorder*)recorder)->compile_loop();
+  return 0;
+}
+
+/// compile_loop - The body of the compiler thread.  Compile queued trees,
+/// freeing the code they supersede as soon as the interpreter is done with
+/// it, until the recorder is destroyed.
+void BrainFTraceRecorder::compile_loop() {
+  pthread_mutex_lock(&queue_lock);
+  for (;;) {
+    while (compile_queue.empty() && !shutting_down)
+      pthread_cond_wait(&queue_cond, &queue_lock);
+    if (shutting_down) break;
     
-    if (trace_iter->second == Parent->pc+1) {
-      if (Parent->left) Child = Parent->left;
-      else Child = Parent->left =
-        new BrainFTraceNode(trace_iter->first, trace_iter->second, depth);
-    } else {
-      if (Parent->right) Child = Parent->right;
-      else Child = Parent->right =
-        new BrainFTraceNode(trace_iter->first, trace_iter->second, depth);
+    BrainFTrace *trace = compile_queue.front();
+    compile_queue.pop_front();
+    pthread_mutex_unlock(&queue_lock);
+    
+    // Compile only what was added to a tree since it was last compiled, if
+    // that can be done, and otherwise all of it.  Keep the snapshot, in case
+    // the tree needs relinking or extending later.
+    BrainFCompiledTrace &Compiled = compiled[trace->original];
+    if (!compile_branches(trace, Compiled)) {
+      compile(trace);
+      Compiled.unlinked_exits.swap(UnlinkedExits);
     }
+    delete Compiled.snapshot;
+    Compiled.snapshot = trace;
+    relink(trace->root().pc);
+    reclaim();
     
-    Parent = Child;
-    ++trace_iter;
+    pthread_mutex_lock(&queue_lock);
+  }
+  pthread_mutex_unlock(&queue_lock);
+}
+
+/// is_queued - Returns true if a snapshot of tree is waiting to be compiled.
+bool BrainFTraceRecorder::is_queued(BrainFTrace *tree) {
+  pthread_mutex_lock(&queue_lock);
+  bool queued = false;
+  for (std::deque<BrainFTrace*>::iterator I = compile_queue.begin(),
+       E = compile_queue.end(); !queued && I != E; ++I)
+    queued = (*I)->original == tree;
+  pthread_mutex_unlock(&queue_lock);
+  return queued;
+}
+
+/// relink - A trace has just been installed at pc.  Recompile the trees
+/// with side exits to pc that could not be linked when they were compiled,
+/// so that they call it directly, and so on for the traces this installs.
+/// Trees with a newer snapshot waiting in the queue are left to it.
+void BrainFTraceRecorder::relink(size_t pc) {
+  std::vector<size_t> Installed(1, pc);
+  while (!Installed.empty()) {
+    size_t head = Installed.back();
+    Installed.pop_back();
+    
+    for (DenseMap<BrainFTrace*, BrainFCompiledTrace>::iterator
+         I = compiled.begin(), E = compiled.end(); I != E; ++I) {
+      std::vector<size_t> &Exits = I->second.unlinked_exits;
+      if (std::find(Exits.begin(), Exits.end(), head) == Exits.end() ||
+          is_queued(I->first))
+        continue;
+      
+      compile(I->second.snapshot);
+      ++Stats.relink_compiles;
+      Exits.swap(UnlinkedExits);
+      Installed.push_back(I->second.snapshot->root().pc);
+    }
   }
-  
-  if (Parent->pc+1 == extension_root->pc)
-    Parent->left = (BrainFTraceNode*)~0ULL;
-  else
-    Parent->right = (BrainFTraceNode*)~0ULL;
 }
 
 void
-BrainFTraceRecorder::record_simple(size_t pc, uint8_t opcode, size_t next_pc) {
+BrainFTraceRecorder::record_slow(size_t pc, uint8_t opcode, size_t next_pc) {
   if (mode == MODE_RECORDING) {
-    if (opcode == ']' && next_pc != trace_begin->second) {
-      ++backedge_count;
-      if (backedge_count > BACKEDGE_THRESHOLD) {
-        backedge_count = 0;
-        mode = MODE_PROFILING;
-        return;
-      }
+    if (opcode == ']' && next_pc != trace_begin->second &&
+        ++backedge_count > backedge_limit) {
+      abort_recording(true);
+      return;
     }
     
     if (trace_tail == trace_end) {
-      mode = MODE_PROFILING;
+      abort_recording(false);
     } else {
       trace_tail->first = opcode;
       trace_tail->second = pc;
@@ -155,50 +397,72 @@ BrainFTraceRecorder::record_simple(size_t pc, uint8_t opcode, size_t next_pc) {
       
       if (next_pc == trace_begin->second) {
         commit();
-        compile(trace_map[next_pc]);
-        mode = MODE_PROFILING;
+        schedule_compile(trace_map[next_pc]);
+        set_mode(MODE_PROFILING);
       }
     }
   } else if (mode == MODE_EXTENSION_BEGIN) {
-    if (blacklist.count(pc)) {
-      mode = MODE_PROFILING;
-    } else {
-      trace_tail = trace_begin;
-      backedge_count = 0;
-      mode = MODE_EXTENSION;
+    if (begin_extension(pc))
       record_simple(pc, opcode, next_pc);
-    }
   } else if (mode == MODE_EXTENSION) {
-    if (opcode == ']' && next_pc != extension_root->pc) {
-      ++backedge_count;
-      if (backedge_count > BACKEDGE_THRESHOLD) {
-        blacklist.insert(trace_begin->second);
-        backedge_count = 0;
-        mode = MODE_PROFILING;
-        return;
-      }
+    if (opcode == ']' && next_pc != extension_root->root().pc &&
+        ++backedge_count > backedge_limit) {
+      abort_recording(true);
+      return;
     }
     
-    if (trace_tail + extension_leaf->depth >= trace_end) {
-      mode = MODE_PROFILING;
+    if (trace_tail + extension_root->nodes[extension_leaf].depth >=
+        trace_end) {
+      abort_recording(false);
     } else {
       trace_tail->first = opcode;
       trace_tail->second = pc;
       ++trace_tail;
       
-      if (next_pc == extension_root->pc) {
+      if (next_pc == extension_root->root().pc) {
         commit_extension();
-        compile(extension_root);
-        mode = MODE_PROFILING;
+        blacklist.erase(extension_pc);
+        schedule_compile(extension_root);
+        set_mode(MODE_PROFILING);
       }
     }
   }
 }
 
+/// enter_call - Prepare to record a call to the compiled trace at pc, which
+/// may be the first instruction of an extension.
+void BrainFTraceRecorder::enter_call(size_t pc) {
+  if (mode == MODE_EXTENSION_BEGIN)
+    begin_extension(pc);
+  call_root = extension_root;
+  call_leaf = extension_leaf;
+}
+
+/// record_call - Record a call to the compiled trace at pc, which returned
+/// next_pc.  Only a trace that left its loop through the '[' at its head is
+/// recorded as a call; one that side exited elsewhere ends the recording,
+/// and may be extended instead.
+void BrainFTraceRecorder::record_call(size_t pc, size_t next_pc) {
+  if (mode != MODE_RECORDING && mode != MODE_EXTENSION) {
+    exit_trace();
+    return;
+  }
+  
+  if (next_pc != pc+1 && next_pc != VM->code[pc].target+1) {
+    abort_recording(false);
+    exit_trace();
+    return;
+  }
+  
+  extension_root = call_root;
+  extension_leaf = call_leaf;
+  record(pc, 'T', next_pc);
+}
+
 void BrainFTraceRecorder::record(size_t pc, uint8_t opcode, size_t next_pc) {
   if (mode == MODE_RECORDING) {
     if (trace_tail == trace_end) {
-      mode = MODE_PROFILING;
+      abort_recording(false);
       record(pc, opcode, next_pc);
     } else {
       trace_tail->first = opcode;
@@ -207,38 +471,33 @@ void BrainFTraceRecorder::record(size_t pc, uint8_t opcode, size_t next_pc) {
       
       if (next_pc == trace_begin->second) {
         commit();
-        compile(trace_map[next_pc]);
-        mode = MODE_PROFILING;
+        schedule_compile(trace_map[next_pc]);
+        set_mode(MODE_PROFILING);
       }
     }
   } else if (mode == MODE_PROFILING){
-    size_t hash = pc % ITERATION_BUF_SIZE;
-    if (iteration_count[hash] == 255) iteration_count[hash] = 254;
-    if (++iteration_count[hash] > TRACE_THRESHOLD) {
-      trace_begin->first = opcode;
-      trace_begin->second = pc;
-      trace_tail = trace_begin+1;
-      backedge_count = 0;
-      mode = MODE_RECORDING;
-    }
+    profile(pc);
   } else if (mode == MODE_EXTENSION_BEGIN) {
-    trace_tail = trace_begin;
-    mode = MODE_EXTENSION;
-    record(pc, opcode, next_pc);
+    if (begin_extension(pc))
+      record(pc, opcode, next_pc);
+    else
+      profile(pc);
   } else if (mode == MODE_EXTENSION) {
-    if (trace_tail + extension_leaf->depth >= trace_end) {
-      mode = MODE_PROFILING;
+    if (trace_tail + extension_root->nodes[extension_leaf].depth >=
+        trace_end) {
+      abort_recording(false);
       record(pc, opcode, next_pc);
     } else {
       trace_tail->first = opcode;
       trace_tail->second = pc;
       ++trace_tail;
       
-      if (next_pc == extension_root->pc) {
+      if (next_pc == extension_root->root().pc) {
         commit_extension();
-        compile(extension_root);
-        mode = MODE_PROFILING;
+        blacklist.erase(extension_pc);
+        schedule_compile(extension_root);
+        set_mode(MODE_PROFILING);
       }
     }
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,385 @@
+//===-- BrainFVM.cpp - BrainF virtual machine -----------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------===//
+//
+// Loading a program into a VM, and running it.
+//===--------------------------------------------------------------------===//
+
+#include "BrainFVM.h"
+#include "llvm/ADT/StringExtras.h"
+#include <map>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/// analyze_loop - Determine whether the loop body in [Begin, End) of the
+/// preprocessed bytecode is a multiply/copy loop: a balanced loop without I/O
+/// or nested loops that steps its counter cell by one each iteration.  If it
+/// is, fill Factors with the amount each iteration adds to every other cell,
+/// scaled so that the loop is equivalent to data[offset] += factor * data[0]
+/// for each entry followed by data[0] = 0.
+static bool analyze_loop(BrainFVM *VM, size_t Begin, size_t End,
+                         std::map<int32_t, int32_t> &Factors) {
+  // Pending pointer motion is flushed before ']', so a body made only of
+  // op_add leaves the data pointer where it found it.
+  std::map<int32_t, int32_t> Deltas;
+  for (size_t pc = Begin; pc != End; ++pc) {
+    if (VM->code[pc].opcode != OP_ADD)
+      return false;
+    Deltas[VM->code[pc].offset] += VM->code[pc].value;
+  }
+  
+  // The loop runs data[0] times when the counter is decremented, and
+  // -data[0] (mod 256) times when it is incremented.
+  int8_t Step = (int8_t)Deltas[0];
+  if (Step != -1 && Step != 1)
+    return false;
+  
+  for (std::map<int32_t, int32_t>::iterator I = Deltas.begin(),
+       E = Deltas.end(); I != E; ++I)
+    if (I->first != 0 && (uint8_t)I->second != 0)
+      Factors[I->first] = -Step * I->second;
+  return true;
+}
+
+/// LOAD_CHUNK - The number of source bytes loaded before a lazily loaded
+/// program is started.  Each later load takes twice as many as the last.
+#define LOAD_CHUNK (1 << 16)
+
+#if defined(__AVX2__)
+#define LEX_WIDTH 32
+typedef __m256i lex_vec;
+static inline lex_vec lex_load(const uint8_t *p) {
+  return _mm256_loadu_si256((const __m256i*)p);
+}
+static inline lex_vec lex_eq(lex_vec v, char c) {
+  return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+}
+static inline lex_vec lex_or(lex_vec a, lex_vec b) {
+  return _mm256_or_si256(a, b);
+}
+static inline uint32_t lex_mask(lex_vec v) {
+  return _mm256_movemask_epi8(v);
+}
+#elif defined(__SSE2__)
+#define LEX_WIDTH 16
+typedef __m128i lex_vec;
+static inline lex_vec lex_load(const uint8_t *p) {
+  return _mm_loadu_si128((const __m128i*)p);
+}
+static inline lex_vec lex_eq(lex_vec v, char c) {
+  return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+}
+static inline lex_vec lex_or(lex_vec a, lex_vec b) {
+  return _mm_or_si128(a, b);
+}
+static inline uint32_t lex_mask(lex_vec v) {
+  return _mm_movemask_epi8(v);
+}
+#else
+#define LEX_WIDTH 32
+#endif
+
+/// lex - Returns a bitmask of the instruction characters among the first
+/// size bytes at block, of which at most LEX_WIDTH are examined, and sets
+/// Opens and Closes to the masks of the '[' and ']' among them.  Full
+/// blocks are classified with vector compares; everything else is left as
+/// comments.
+static inline uint32_t lex(const uint8_t *block, size_t size,
+                           uint32_t &Opens, uint32_t &Closes) {
+#if defined(__AVX2__) || defined(__SSE2__)
+  if (size >= LEX_WIDTH) {
+    lex_vec Bytes = lex_load(block);
+    lex_vec Open = lex_eq(Bytes, '['), Close = lex_eq(Bytes, ']');
+    lex_vec Any = lex_or(lex_or(Open, Close),
+                         lex_or(lex_or(lex_eq(Bytes, '+'), lex_eq(Bytes, '-')),
+                                lex_or(lex_eq(Bytes, '<'), lex_eq(Bytes, '>'))));
+    Any = lex_or(Any, lex_or(lex_eq(Bytes, '.'), lex_eq(Bytes, ',')));
+    Opens = lex_mask(Open);
+    Closes = lex_mask(Close);
+    return lex_mask(Any);
+  }
+#endif
+  
+  uint32_t Mask = 0;
+  Opens = Closes = 0;
+  if (size > LEX_WIDTH) size = LEX_WIDTH;
+  for (size_t i = 0; i != size; ++i) {
+    switch (block[i]) {
+      case '[': Opens |= 1U << i; break;
+      case ']': Closes |= 1U << i; break;
+      case '+': case '-': case '<': case '>': case '.': case ',': break;
+      default: continue;
+    }
+    Mask |= 1U << i;
+  }
+  return Mask;
+}
+
+/// load - Preprocess more of the source of VM.  Loading stops at the first
+/// loop outside of any other that begins at least limit bytes further on,
+/// leaving OP_END in its place, or otherwise at the end of the source.  The
+/// brackets are known to match.
+static void load(BrainFVM *VM, size_t limit) {
+  const uint8_t *Cur = VM->source_cur, *End = VM->source_end;
+  const uint8_t *Stop = (size_t)(End - Cur) > limit ? Cur + limit : End;
+  size_t BytecodeOffset = VM->code_size, Mapped = BytecodeOffset;
+  std::vector<uint32_t> Stack;
+  std::map<int32_t, int32_t> Factors;
+  
+  // Pointer motion is deferred across a basic block: '<' and '>' only adjust
+  // PendingMove, and '+'/'-' become an op_add at that offset from the data
+  // pointer.  The accumulated motion is flushed as a single op_move before
+  // any instruction that depends on where the data pointer actually is, and
+  // whenever it reaches MAX_OFFSET.
+  int32_t PendingMove = 0;
+  
+  // Preprocess the input source code, performing four tasks:
+  //  1 - Remove non-instruction characters, a block at a time
+  //  2 - Fold runs of '+'/'-' and '<'/'>' into op_add and op_move
+  //  3 - Replace character literals with opcodes
+  //  4 - Precompute the jump targets for [ and ] instructions
+  while (Cur != End) {
+    size_t Width = End - Cur < LEX_WIDTH ? End - Cur : LEX_WIDTH;
+    uint32_t Opens, Closes;
+    for (uint32_t Mask = lex(Cur, Width, Opens, Closes); Mask;
+         Mask &= Mask - 1) {
+      const uint8_t *Char = Cur + __builtin_ctz(Mask);
+      uint8_t opcode = *Char;
+      
+      if ((PendingMove && (opcode == '[' || opcode == ']' ||
+                           opcode == '.' || opcode == ',')) ||
+          PendingMove == MAX_OFFSET || PendingMove == -MAX_OFFSET) {
+        VM->code[BytecodeOffset].offset = 0;
+        VM->code[BytecodeOffset].value = PendingMove;
+        VM->code[BytecodeOffset++].opcode = OP_MOVE;
+        PendingMove = 0;
+      }
+      
+      switch (opcode) {
+        case '>':
+          ++PendingMove;
+          break;
+        case '<':
+          --PendingMove;
+          break;
+        case '+':
+        case '-': {
+          int32_t Delta = opcode == '+' ? 1 : -1;
+        
+          // Fold into the preceding add if it targets the same cell, and drop
+          // it altogether if the two cancel out.
+          if (BytecodeOffset && VM->code[BytecodeOffset-1].opcode == OP_ADD &&
+              VM->code[BytecodeOffset-1].offset == PendingMove) {
+            if ((VM->code[BytecodeOffset-1].value += Delta) == 0)
+              --BytecodeOffset;
+            break;
+          }
+        
+          VM->code[BytecodeOffset].offset = PendingMove;
+          VM->code[BytecodeOffset].value = Delta;
+          VM->code[BytecodeOffset++].opcode = OP_ADD;
+          break;
+        }
+        case '.':
+          VM->code[BytecodeOffset++].opcode = OP_PUT;
+          break;
+        case ',':
+          VM->code[BytecodeOffset++].opcode = OP_GET;
+          break;
+        case '[':
+          // Stop before a loop outside of any other, once past Stop.  All
+          // of the instructions before it are final.
+          if (Stack.empty() && Char >= Stop) {
+            Cur = Char;
+            goto suspend;
+          }
+        
+          // The slot may have held an instruction since folded away, whose
+          // offset would be taken for the profile count.
+          Stack.push_back(BytecodeOffset);
+          VM->code[BytecodeOffset].count = 0;
+          VM->code[BytecodeOffset++].opcode = OP_IF;
+          break;
+        case ']':
+          // Special case: [>], [<<] and the like become op_scan.
+          if (BytecodeOffset == Stack.back()+2 &&
+              VM->code[BytecodeOffset-1].opcode == OP_MOVE) {
+            VM->code[Stack.back()].value = VM->code[BytecodeOffset-1].value;
+            BytecodeOffset = Stack.back();
+            Stack.pop_back();
+            VM->code[BytecodeOffset++].opcode = OP_SCAN;
+            break;
+          }
+        
+          // Special case: balanced counting loops such as [-] and [->+<]
+          // become a sequence of op_mul followed by op_set_zero.
+          Factors.clear();
+          if (analyze_loop(VM, Stack.back()+1, BytecodeOffset, Factors)) {
+            BytecodeOffset = Stack.back();
+            Stack.pop_back();
+            for (std::map<int32_t, int32_t>::iterator I = Factors.begin(),
+                 E = Factors.end(); I != E; ++I) {
+              VM->code[BytecodeOffset].offset = I->first;
+              VM->code[BytecodeOffset].value = I->second;
+              VM->code[BytecodeOffset++].opcode = OP_MUL;
+            }
+            VM->code[BytecodeOffset++].opcode = OP_SET_ZERO;
+          } else {
+            VM->code[Stack.back()].target = BytecodeOffset;
+            VM->code[BytecodeOffset].target = Stack.back();
+            Stack.pop_back();
+            VM->code[BytecodeOffset].offset = Stack.empty() ? -1
+                                                            : Stack.back();
+            VM->code[BytecodeOffset++].opcode = OP_BACK;
+          }
+          break;
+      }
+      
+      // Map the instructions just emitted back to this character.  Those
+      // rewritten in place by a scan or multiply keep a character of the
+      // loop they came from.
+      if (VM->source_map) {
+        if (Mapped > BytecodeOffset)
+          Mapped = BytecodeOffset;
+        for (; Mapped < BytecodeOffset; ++Mapped)
+          VM->source_map[Mapped] = Char - VM->source_begin;
+      }
+    }
+    Cur += Width;
+  }
+  
+suspend:
+  // A move flushed before the loop that loading stopped at belongs to the
+  // loop's '[', as it would had loading gone on.
+  if (VM->source_map)
+    for (; Mapped < BytecodeOffset; ++Mapped)
+      VM->source_map[Mapped] = Cur - VM->source_begin;
+  
+  // The program is followed by OP_END, both at the very end, and where
+  // loading will resume.
+  VM->source_cur = Cur;
+  VM->code_size = BytecodeOffset;
+  VM->code[BytecodeOffset].opcode = OP_END;
+}
+
+BrainFVM *brainf_vm_create(const uint8_t *source, size_t size,
+                           std::string &error, bool lazy, bool source_map) {
+  // Check that the brackets match before loading anything, so that a lazily
+  // loaded program never finds out part way through that it is malformed,
+  // and count the instructions.  Folding only ever merges instructions, so
+  // the program has at most as many instructions as the source has
+  // instruction characters.  Most blocks have no more ']' than there are
+  // loops open, and need not be looked at bracket by bracket.
+  size_t Capacity = 1, Depth = 0;
+  for (size_t i = 0; i < size; i += LEX_WIDTH) {
+    uint32_t Opens, Closes;
+    Capacity += __builtin_popcount(lex(source + i, size - i, Opens, Closes));
+    if ((size_t)__builtin_popcount(Closes) <= Depth) {
+      Depth += __builtin_popcount(Opens);
+      Depth -= __builtin_popcount(Closes);
+      continue;
+    }
+    for (uint32_t Brackets = Opens | Closes; Brackets;
+         Brackets &= Brackets - 1) {
+      unsigned Bit = __builtin_ctz(Brackets);
+      if (Opens & (1U << Bit)) {
+        ++Depth;
+      } else if (Depth-- == 0) {
+        error = "unmatched ']' at byte " + utostr(i + Bit);
+        return 0;
+      }
+    }
+  }
+  if (Depth) {
+    error = "unmatched '['";
+    return 0;
+  }
+  if (Capacity > (size_t)~0U) {
+    error = "the program has too many instructions";
+    return 0;
+  }
+  
+  BrainFVM *VM = new BrainFVM();
+  VM->output_fd = 1;
+  VM->input_fd = 0;
+  VM->output_cur = VM->output_buffer;
+  VM->output_end = VM->output_buffer + IO_BUF_SIZE;
+  VM->input_cur = VM->input_end = VM->input_buffer;
+  
+  // Size the code and the trace array by the instructions, leaving out the
+  // comments, with room for the final OP_END.
+  VM->code = new BrainFInsn[Capacity];
+  memset(VM->code, 0, sizeof(BrainFInsn) * Capacity);
+  VM->traces = new opcode_func_t[Capacity];
+  memset(VM->traces, 0, sizeof(opcode_func_t) * Capacity);
+  
+  if (source_map)
+    VM->source_map = new size_t[Capacity];
+  
+  VM->source_begin = VM->source_cur = source;
+  VM->source_end = source + size;
+  load(VM, lazy ? LOAD_CHUNK : ~(size_t)0);
+  return VM;
+}
+
+bool brainf_source_location(BrainFVM *vm, size_t pc, unsigned &line,
+                            unsigned &column) {
+  if (!vm->source_map)
+    return false;
+  const uint8_t *Cur = vm->source_begin;
+  const uint8_t *Char = pc < vm->code_size ? Cur + vm->source_map[pc]
+                                           : vm->source_cur;
+  line = 1;
+  while (const uint8_t *Newline =
+           (const uint8_t*)memchr(Cur, '\n', Char - Cur)) {
+    ++line;
+    Cur = Newline + 1;
+  }
+  column = Char - Cur + 1;
+  return true;
+}
+
+bool brainf_vm_run(BrainFVM *vm, size_t tape_offset, bool huge_pages) {
+  vm->data = brainf_tape_create(vm->tape, tape_offset, huge_pages);
+  
+  // Main interpreter loop.  interpret() dispatches in a loop, and compiled
+  // traces return the pc at which they exit rather than calling onward, so
+  // the stack depth stays constant however long the program runs.  A
+  // program that moves off its tape comes back here from the fault handler,
+  // in the middle of whatever it was running.
+  RunningVM = vm;
+  bool Completed = !sigsetjmp(vm->tape_exit, 1);
+  if (Completed) {
+    // Run each part of a lazily loaded program as soon as it is loaded.
+    size_t pc = interpret(vm, 0);
+    for (size_t Chunk = LOAD_CHUNK * 2; vm->source_cur != vm->source_end;
+         Chunk *= 2) {
+      load(vm, Chunk);
+      pc = interpret(vm, pc);
+    }
+  } else
+    Stats.in_trace = 0;
+  RunningVM = 0;
+  
+  brainf_flush(vm);
+  brainf_tape_destroy(vm->tape);
+  return Completed;
+}
+
+void brainf_vm_destroy(BrainFVM *vm) {
+  delete vm->recorder;
+  delete[] vm->code;
+  delete[] vm->traces;
+  delete[] vm->source_map;
+  delete vm;
+}
@@ -12,51 +12,312 @@
 
 #include "BrainF.h"
 #include "stdint.h"
+#include <csetjmp>
 #include <cstring>
 
-/// opcode_func_t - A function pointer signature for all opcode functions.
-typedef void(*opcode_func_t)(size_t pc, uint8_t* data);
+struct BrainFVM;
 
-/// BytecodeArray - An array of function pointers representing the
-/// source program.  Indexed by PC address.
-extern opcode_func_t *BytecodeArray;
+/// opcode_func_t - A function pointer signature for compiled traces.  A
+/// trace runs from the trace head at pc, updates the data pointer of the VM
+/// in place, and returns the pc at which the interpreter should resume.
+typedef size_t(*opcode_func_t)(size_t pc, BrainFVM *vm);
 
-/// JumpMap - An array of on-the-side data used by the interpreter.
-/// Indexed by PC address.
-extern size_t *JumpMap;
+/// BrainFOpcode - The instruction set of the preprocessed program.
+enum BrainFOpcode {
+  OP_ADD,
+  OP_MOVE,
+  OP_SCAN,
+  OP_MUL,
+  OP_PUT,
+  OP_GET,
+  OP_IF,
+  OP_BACK,
+  OP_SET_ZERO,
+  OP_TRACE,
+  OP_END
+};
 
-/// Recorder - The trace recording engine.
-extern BrainFTraceRecorder *Recorder;
+/// BrainFInsn - An instruction of the preprocessed program, with its
+/// operands inline, so that dispatching an instruction and executing it
+/// touch the same twelve bytes.
+///
+/// For op_add, value is added to the cell at offset from the data pointer.
+/// For op_move, value is the signed distance the data pointer moves, and for
+/// op_scan it is the stride of the scan.  For op_mul, value is the factor by
+/// which the current cell is multiplied before being added to the cell at
+/// offset.
+///
+/// For a '[' or ']', target is the pc of the matching bracket.  The rest is
+/// only used by the recorder.  For a '[', count is the number of times the
+/// loop header has been profiled, and the backoffs scale the thresholds for
+/// recording a trace from it by a power of two for every recording from it
+/// that has failed.  For a ']', offset is the pc of the '[' of the loop
+/// around this one, or -1 if there is none.
+struct BrainFInsn {
+  uint8_t opcode;
+  uint8_t trace_backoff;
+  uint8_t backedge_backoff;
+  union {
+    int32_t offset;
+    uint32_t count;
+  };
+  union {
+    int32_t value;
+    uint32_t target;
+  };
+};
 
-/// op_plus - Implements the '+' instruction.
-void op_plus(size_t, uint8_t*);
+/// brainf_scan - Returns the first zero cell at or after data along the given
+/// stride, examining a vector register's worth of cells at a time.  Shared by
+/// the interpreter and compiled traces.
+uint8_t *brainf_scan(uint8_t *data, int32_t stride);
 
-/// op_minus - Implements the '-' instruction.
-void op_minus(size_t, uint8_t*);
+/// TAPE_RESERVE - The address space reserved for the cells to the right of
+/// the starting cell.
+#define TAPE_RESERVE (sizeof(void*) == 8 ? (size_t)1 << 36 : (size_t)1 << 28)
 
-// op_left - Implements the '<' instruction.
-void op_left(size_t, uint8_t*);
+/// MAX_OFFSET - The furthest an instruction reaches from the data pointer,
+/// and the furthest it moves it: less than the guard page at either end of
+/// a tape, so that from anywhere in [begin, end) it cannot reach past them.
+#define MAX_OFFSET 4095
 
-// op_right - Implements the '>' instruction.
-void op_right(size_t, uint8_t*);
+/// BrainFTape - A tape: a large region of address space, of which only the
+/// window [commit_begin, commit_end) of offsets from base is accessible.
+/// The data pointer may lie anywhere in [begin, end), which leaves out the
+/// guard pages at either end.
+struct BrainFTape {
+  uint8_t *base;
+  size_t size;
+  size_t commit_begin, commit_end;
+  uint8_t *begin, *end;
+};
 
-// op_put - Implements the '.' instruction.
-void op_put(size_t, uint8_t*);
+/// brainf_tape_create - Reserves a tape, with start_offset cells to the left
+/// of the starting cell, and installs the handler that grows the tapes on
+/// demand if no other tape has.  Returns a pointer to the starting cell.
+uint8_t *brainf_tape_create(BrainFTape &tape, size_t start_offset,
+                            bool huge_pages);
 
-// op_get - Implements the ',' instruction.
-void op_get(size_t, uint8_t*);
+/// brainf_tape_destroy - Releases a tape, and removes the fault handler if
+/// it was the last.
+void brainf_tape_destroy(BrainFTape &tape);
 
-// op_if - Implements the '[' instruction.
-void op_if(size_t, uint8_t*);
+/// IO_BUF_SIZE - The size of the VM's output buffer and input read-ahead
+/// buffer.
+#define IO_BUF_SIZE 65536
 
-// op_back - Implements the ']' instruction.
-void op_back(size_t, uint8_t*);
+/// BrainFVM - A program loaded to run, and everything it runs with: its
+/// preprocessed code, its tape and I/O buffers, and the recorder that
+/// traces and compiles it.  VMs share nothing but the fault handler of the
+/// tapes, so any number of them can run at once, each on one thread at a
+/// time.
+///
+/// The data pointer is the first field, so that a pointer to the VM is also
+/// a pointer to its data pointer.  That is how compiled traces are passed
+/// the VM: they load and store the data pointer through it, and pass it on
+/// to the traces and runtime functions they call.
+struct BrainFVM {
+  uint8_t *data;
+  
+  // The preprocessed program and the compiled traces installed in it, both
+  // indexed by pc.  The code_size instructions of the program are followed
+  // by OP_END.  A trace-head pc whose opcode has been replaced by OP_TRACE
+  // holds its trace in traces, which is kept apart from the code as it is
+  // only read on entering a trace.
+  BrainFInsn *code;
+  opcode_func_t *traces;
+  size_t code_size;
+  
+  // The compiler thread frees the code of a superseded trace once the
+  // thread running the VM has returned from every trace it was in when the
+  // code was retired.  It bumps retire_epoch as it retires code, and the
+  // interpreter copies that to quiescent_epoch each time a trace returns.
+  volatile size_t retire_epoch, quiescent_epoch;
+  
+  // The source still to be preprocessed, if the program is loaded lazily.
+  // Loading only ever stops before a loop outside of any other, so all of
+  // the code before it is final.
+  const uint8_t *source_cur, *source_end;
+  
+  // The start of the source, and if it was asked for, the offset into it of
+  // the character each instruction was preprocessed from, indexed by pc.
+  const uint8_t *source_begin;
+  size_t *source_map;
+  
+  BrainFTraceRecorder *recorder;
+  
+  // Set by -count-ops to have the interpreter count the instructions it
+  // executes in Stats.ops_executed, and by -profile to have it keep
+  // sample_pc up to date for the sampling profiler.  Either way the
+  // interpreter runs its instrumented variant.
+  bool count_ops;
+  bool profile;
+  volatile size_t sample_pc;
+  
+  // Set by -safe to check that the program stays on its tape: in the
+  // interpreter, on each move, and in compiled traces, once on entering
+  // each stretch of a trace for all the moves along it.
+  bool safe;
+  
+  BrainFTape tape;
+  
+  // The next free byte and the end of the output buffer, and the next unread
+  // byte and the end of the input read ahead.  Output is gathered in
+  // output_buffer, and written to output_fd when the buffer fills, before
+  // input is read, and when the program ends, or appended to output if
+  // output_fd is -1.  Input is read ahead into input_buffer from input_fd,
+  // or if input_fd is -1, all of it is in place from the start.
+  uint8_t *output_cur, *output_end, *input_cur, *input_end;
+  int output_fd, input_fd;
+  std::string *output;
+  uint8_t output_buffer[IO_BUF_SIZE];
+  uint8_t input_buffer[IO_BUF_SIZE];
+  
+  // Where brainf_vm_run resumes if the program moves off its tape.
+  sigjmp_buf tape_exit;
+};
 
-// op_set_zero - Implements the '0' synthetic instruction.
-void op_set_zero(size_t, uint8_t*);
+/// RunningVM - The VM running on this thread, if any.  The tape fault
+/// handler runs on the thread that faulted, and finds the tape through it.
+extern __thread BrainFVM *RunningVM;
 
-// op_end - Terminates an execution.
-void op_end(size_t, uint8_t*);
+/// brainf_vm_create - Preprocess the program in [source, source+size) into
+/// a new VM, which reads standard input and writes standard output, and has
+/// no recorder yet.  Returns null, having set error, if the brackets of the
+/// program do not match.
+///
+/// If lazy, only the start of the program is preprocessed, and the rest as
+/// brainf_vm_run reaches it, so that a large program starts running early.
+/// The source must then stay alive until the run is over, and the program
+/// is not whole before that for the trace cache or -aot.
+///
+/// If source_map, the VM keeps where in the source each instruction came
+/// from, for brainf_source_location.
+BrainFVM *brainf_vm_create(const uint8_t *source, size_t size,
+                           std::string &error, bool lazy = false,
+                           bool source_map = false);
+
+/// brainf_source_location - Find the line and column, counting from 1, of
+/// the character in the source of vm that the instruction at pc came from.
+/// Returns false if vm has no source map.  The source must still be alive.
+bool brainf_source_location(BrainFVM *vm, size_t pc, unsigned &line,
+                            unsigned &column);
+
+/// brainf_vm_run - Run the program of vm on this thread until it ends, with
+/// tape_offset cells to the left of the starting cell, and flush its output.
+/// Returns false if the program moved off the end of its tape, which stops
+/// it.
+bool brainf_vm_run(BrainFVM *vm, size_t tape_offset, bool huge_pages);
+
+/// brainf_vm_destroy - Free vm and its recorder.
+void brainf_vm_destroy(BrainFVM *vm);
+
+/// brainf_flush - Writes out the contents of the output buffer of vm, and
+/// returns the new output_cur.
+uint8_t *brainf_flush(BrainFVM *vm);
+
+/// brainf_refill - Flushes the output buffer of vm, then reads ahead more
+/// input.  Returns the first byte read, consuming it, or 255 at the end of
+/// input.
+uint8_t brainf_refill(BrainFVM *vm);
+
+/// brainf_putc - Appends a byte to the output buffer.
+static inline void brainf_putc(BrainFVM *vm, uint8_t c) {
+  if (vm->output_cur == vm->output_end) brainf_flush(vm);
+  *vm->output_cur++ = c;
+}
+
+/// brainf_getc - Returns the next byte of input, or 255 at the end of input.
+static inline uint8_t brainf_getc(BrainFVM *vm) {
+  return vm->input_cur != vm->input_end ? *vm->input_cur++
+                                        : brainf_refill(vm);
+}
+
+/// BrainFStats - The counters reported by -stats.  Each is only written by
+/// one thread, and they are only read once the compiler thread has stopped.
+/// They are kept for the whole process: when several VMs run at once, their
+/// counts are merged, and may lose the odd increment.
+struct BrainFStats {
+  uint64_t traces_recorded;
+  uint64_t extensions_recorded;
+  uint64_t recordings_aborted;
+  uint64_t trace_entries;
+  uint64_t tier1_compiles;
+  uint64_t tier2_compiles;
+  uint64_t relink_compiles;
+  uint64_t branch_compiles;
+  uint64_t optimize_usec;
+  uint64_t codegen_usec;
+  uint64_t code_bytes;
+  uint64_t code_peak_bytes;
+  uint64_t traces_freed;
+  uint64_t interpreting_ms;
+  uint64_t tracing_ms;
+  uint64_t compiling_ms;
+  uint64_t ops_executed;
+  
+  // When the program started, and how long after that the first compiled
+  // trace was installed, in microseconds.
+  uint64_t start_usec;
+  uint64_t first_trace_usec;
+  
+  // Set while the interpreter thread is running compiled code, for the
+  // benefit of the sampler.
+  volatile uint8_t in_trace;
+};
+extern BrainFStats Stats;
+
+/// brainf_stats_compile - Called by the compiler thread once it has
+/// compiled code_bytes of code for the tree of the loop at pc, to add the
+/// time it spent optimizing and generating that code to the loop's own.
+void brainf_stats_compile(size_t pc, uint64_t optimize_usec,
+                          uint64_t codegen_usec, size_t code_bytes);
+
+/// brainf_sampler_start - Begins sampling where the process spends its CPU
+/// time, for -stats.
+void brainf_sampler_start();
+
+/// brainf_sampler_stop - Stops the sampler started by brainf_sampler_start,
+/// and divides the CPU time used in between among the *_ms counters.
+void brainf_sampler_stop();
+
+/// brainf_print_stats - Prints the counters and the compile costs of each
+/// trace, either in the layout of LLVM's own -stats or as a single JSON
+/// object.
+void brainf_print_stats(raw_ostream &OS, bool json);
+
+/// brainf_profile_open - Begins profiling vm, whose source was read from
+/// program.  If perf, the code compiled for it is described to perf; if
+/// sample, the sampler attributes its samples to the loops of the source.
+void brainf_profile_open(BrainFVM *vm, const std::string &program,
+                         bool perf, bool sample);
+
+/// brainf_profile_code - Called by the compiler thread once it has
+/// installed size bytes of code at code for the loop at pc of vm, as the
+/// given kind of code.  Does nothing unless vm is being profiled.
+void brainf_profile_code(BrainFVM *vm, size_t pc, const char *kind,
+                         void *code, size_t size);
+
+/// brainf_profile_sample - Called by the sampler on the interpreter thread
+/// with the instruction pointer it interrupted.
+void brainf_profile_sample(bool in_trace, void *ip);
+
+/// brainf_profile_close - Finishes the files written for perf and prints
+/// the hot-spot report, if sampling.  The source must still be alive.
+void brainf_profile_close(raw_ostream &OS);
+
+/// profile - Count an execution of the loop header at pc, and begin
+/// recording a trace from it once it becomes hot.  Only called while
+/// is_recording() is false.
+inline void BrainFTraceRecorder::profile(size_t pc) {
+  BrainFInsn &Head = VM->code[pc];
+  if (++Head.count > (uint32_t)TRACE_THRESHOLD << Head.trace_backoff)
+    begin_trace(pc);
+}
+
+/// interpret - Executes the program of vm starting at pc until it reaches
+/// OP_END, updating vm->data in place.  Returns the pc of the OP_END.
+size_t interpret(BrainFVM *vm, size_t pc);
 
 
 #endif
\ No newline at end of file
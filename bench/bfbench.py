@@ -0,0 +1,190 @@
+#!/usr/bin/env python
+##===- bench/bfbench.py - BrainF benchmark harness --------*- Python -*-===##
+#
+#                     The LLVM Compiler Infrastructure
+#
+# This file is distributed under the University of Illinois Open Source
+# License. See LICENSE.TXT for details.
+#
+##===----------------------------------------------------------------------===##
+#
+# Runs the programs listed in bench/corpus.txt with the interpreter alone
+# (-no-jit), with the tracing JIT, and compiled ahead of time (-aot) into
+# an executable, which needs no warm-up at all.  It replays their input
+# from the files listed there and checks their output against
+# bench/golden.  For each run it reports:
+#
+#   wall  - the best wall time of --runs runs
+#   ops/s - instructions executed per second, where the instructions are
+#           counted once per program by an interpreter-only -count-ops run
+#   first - the time until the first compiled trace was installed, taken
+#           from one more, untimed, -stats-json run, as the timed runs leave
+#           out -stats-json and the sampler it starts
+#   rss   - the peak resident set size
+#
+# With --baseline, the wall times are compared against those saved by an
+# earlier run with --save-baseline, and any that have slowed down by more
+# than --tolerance are reported as regressions, unless they are too short
+# to time reliably.  The exit status is nonzero
+# if any program produced the wrong output or regressed.
+#
+##===----------------------------------------------------------------------===##
+
+from __future__ import print_function
+
+import json
+import optparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+BENCH = os.path.join(ROOT, 'bench')
+
+MODES = [('interp', ['-no-jit']), ('jit', []), ('aot', None)]
+
+# Runs shorter than this, in seconds, are too noisy to flag as regressions.
+MIN_COMPARED = 0.05
+
+
+def read_corpus():
+    """Returns the (program, input) pairs listed in corpus.txt."""
+    corpus = []
+    for line in open(os.path.join(BENCH, 'corpus.txt')):
+        line = line.split('#', 1)[0].split()
+        if not line:
+            continue
+        program, input = line
+        corpus.append((os.path.join(ROOT, program),
+                       None if input == '-' else os.path.join(ROOT, input)))
+    return corpus
+
+
+def compile_aot(tool, program, directory):
+    """Compiles program ahead of time into an executable in directory, and
+    returns its path."""
+    exe = os.path.join(directory, os.path.basename(program) + '.exe')
+    subprocess.check_call([tool, program, '-aot', exe])
+    return exe
+
+
+def run(command, program, input):
+    """Runs command, feeding it input.  Returns its output, its -stats-json
+    counters if it printed any, its wall time in seconds and its peak RSS in
+    kilobytes."""
+    stdin = open(input, 'rb') if input else open(os.devnull, 'rb')
+    stdout = tempfile.TemporaryFile()
+    stderr = tempfile.TemporaryFile()
+    start = time.time()
+    proc = subprocess.Popen(command,
+                            stdin=stdin, stdout=stdout, stderr=stderr)
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.time() - start
+    if os.WIFEXITED(status):
+        status = os.WEXITSTATUS(status)
+    else:
+        status = -os.WTERMSIG(status)
+    proc.returncode = status
+
+    stdout.seek(0)
+    stderr.seek(0)
+    output = stdout.read()
+    errors = stderr.read().decode('utf-8', 'replace')
+    if status != 0:
+        raise RuntimeError('%s exited with status %d:\n%s' %
+                           (os.path.basename(program), status, errors))
+
+    stats = {}
+    for line in errors.splitlines():
+        if line.startswith('{'):
+            stats = json.loads(line)
+    return output, stats, wall, usage.ru_maxrss
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] <BrainFTracing>')
+    parser.add_option('--runs', type='int', default=3,
+                      help='runs of each program in each mode, of which the '
+                           'fastest is reported [%default]')
+    parser.add_option('--mode', action='append', dest='modes',
+                      choices=[name for name, _ in MODES],
+                      help='only run in the given mode (interp, jit or aot)')
+    parser.add_option('--baseline', metavar='FILE',
+                      help='compare wall times against those saved in FILE')
+    parser.add_option('--save-baseline', metavar='FILE',
+                      help='save the wall times to FILE')
+    parser.add_option('--tolerance', type='float', default=0.10,
+                      help='slowdown relative to the baseline reported as '
+                           'a regression [%default]')
+    opts, args = parser.parse_args()
+    if len(args) != 1:
+        parser.error('expected the path of the BrainFTracing binary')
+    tool = os.path.abspath(args[0])
+
+    baseline = {}
+    if opts.baseline:
+        baseline = json.load(open(opts.baseline))
+
+    results = {}
+    failed = False
+    aot_dir = tempfile.mkdtemp()
+    print('%-14s %-6s %9s %12s %9s %9s  %s' %
+          ('program', 'mode', 'wall', 'ops/s', 'first', 'rss', 'baseline'))
+    for program, input in read_corpus():
+        name = os.path.basename(program)
+        golden = open(os.path.join(BENCH, 'golden', name + '.out'), 'rb').read()
+        _, counts, _, _ = run([tool, program, '-stats-json', '-count-ops'],
+                              program, input)
+        ops = counts.get('ops_executed', 0)
+
+        for mode, mode_args in MODES:
+            if opts.modes and mode not in opts.modes:
+                continue
+            if mode_args is None:
+                command = [compile_aot(tool, program, aot_dir)]
+            else:
+                command = [tool, program] + mode_args
+            best, rss = None, 0
+            for i in range(opts.runs):
+                output, _, wall, maxrss = run(command, program, input)
+                if output != golden:
+                    print('%-14s %-6s wrong output' % (name, mode))
+                    failed = True
+                    break
+                best = wall if best is None else min(best, wall)
+                rss = max(rss, maxrss)
+            if best is None:
+                continue
+
+            first = None
+            if mode == 'jit':
+                _, stats, _, _ = run(command + ['-stats-json'], program, input)
+                first = stats.get('first_trace_usec')
+
+            key = '%s/%s' % (name, mode)
+            results[key] = best
+            verdict = ''
+            if key in baseline:
+                change = best / baseline[key] - 1
+                verdict = '%+.1f%%' % (change * 100)
+                if change > opts.tolerance and best >= MIN_COMPARED:
+                    verdict += ' REGRESSION'
+                    failed = True
+            print('%-14s %-6s %8.3fs %12.4g %9s %7dkB  %s' %
+                  (name, mode, best, ops / best if best else 0,
+                   '%.1fms' % (first / 1000.0) if first else '-',
+                   rss, verdict))
+
+    shutil.rmtree(aot_dir)
+    if opts.save_baseline:
+        with open(opts.save_baseline, 'w') as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write('\n')
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,15 @@
+Traces that change a cell and then read it before they loop or leave
+must still write the new value back to the tape
+
+A cell read by an output after it was decremented
+-[-.]
+
+A cell tested by an inner loop and read by an output after they were
+incremented
+++++++++++[>++++++++++++++++++++<-]>
+[->+[->+.<]<]
+
+A multiply loop counter incremented just before the loop
+++++++++++[>++++++++++++++++++++<-]>
+[->+[->+<]<]
+>>.